@@ -0,0 +1,48 @@
+#!/bin/sh
+# Replays traces against mm.c, the C library's malloc, jemalloc and mimalloc,
+# printing their result lines side by side.
+#
+#   bench/compare.sh [-n passes] trace.rep...
+#
+# MM_INCLUDE names the directory holding the handout's mm.h and memlib.h
+# (default: the repository root). JEMALLOC and MIMALLOC name the shared
+# libraries to preload; allocators whose library is not found are skipped.
+# Extra flags for building mm.c can be given in MM_CFLAGS.
+
+set -e
+
+here=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$here")
+out=${TMPDIR:-/tmp}/mm-bench.$$
+mkdir -p "$out"
+trap 'rm -rf "$out"' EXIT
+
+cc=${CC:-gcc}
+cflags="-std=gnu11 -O2 -pthread -I$root -I${MM_INCLUDE:-$root}"
+
+$cc $cflags -o "$out/replay-libc" "$here/replay.c"
+# shellcheck disable=SC2086
+$cc $cflags $MM_CFLAGS -o "$out/replay-mm" "$here/replay.c" "$root/mm.c"
+
+find_lib() {
+    for f in "$@"; do
+        if [ -f "$f" ]; then
+            echo "$f"
+            return
+        fi
+    done
+}
+
+jemalloc=${JEMALLOC:-$(find_lib /usr/lib/x86_64-linux-gnu/libjemalloc.so.2 \
+    /usr/lib64/libjemalloc.so.2 /usr/local/lib/libjemalloc.so.2)}
+mimalloc=${MIMALLOC:-$(find_lib /usr/lib/x86_64-linux-gnu/libmimalloc.so.2 \
+    /usr/lib64/libmimalloc.so.2 /usr/local/lib/libmimalloc.so)}
+
+"$out/replay-mm" "$@"
+"$out/replay-libc" -l glibc "$@" | grep -v '^#'
+if [ -n "$jemalloc" ]; then
+    LD_PRELOAD=$jemalloc "$out/replay-libc" -l jemalloc "$@" | grep -v '^#'
+fi
+if [ -n "$mimalloc" ]; then
+    LD_PRELOAD=$mimalloc "$out/replay-libc" -l mimalloc "$@" | grep -v '^#'
+fi
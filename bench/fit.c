@@ -0,0 +1,146 @@
+/**
+ * @file fit.c
+ * @brief Fit search and coalescing on a large, fragmented heap
+ *
+ * Fills the heap with blocks of random sizes until their total reaches the
+ * requested size, frees a random half of them so that every size class
+ * holds free blocks scattered over the whole heap, and then times random
+ * frees and allocations in that state. Nearly every free list link and
+ * neighbor header the allocator touches is then a cache miss, which is
+ * what the hot traversals have to cope with in large heaps.
+ *
+ * Sizes are drawn from 520 to 4000 bytes by default, above the slab runs
+ * and the thread cache and below the large block tree, so every operation
+ * goes through the size class lists and coalescing. Reports nanoseconds per
+ * operation and, with mm.c, blocks probed per fit search and the final
+ * heap size.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm_ext.h"
+
+/** @brief mm.c's statistics, or NULL with any other allocator */
+extern void mm_stats(mm_stats_t *stats) __attribute__((weak));
+
+static uint64_t rng = 88172645463325252ull;
+
+/** @brief Returns the next value of an xorshift generator */
+static uint64_t next_rand(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+/** @brief Returns a monotonic timestamp in seconds */
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Prints the command line syntax
+ *
+ * @param[in] prog Name the program was run as
+ */
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-m fill_MB] [-n ops] [-s min_size] [-S max_size]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    long heap_mb = 1024;
+    long ops = 4000000;
+    long min_size = 520;
+    long max_size = 4000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:n:s:S:")) != -1) {
+        switch (opt) {
+        case 'm':
+            heap_mb = atol(optarg);
+            break;
+        case 'n':
+            ops = atol(optarg);
+            break;
+        case 's':
+            min_size = atol(optarg);
+            break;
+        case 'S':
+            max_size = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (heap_mb < 1 || ops < 1 || min_size < 1 || max_size < min_size) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    // The slot table is mapped so it does not share the heap it measures
+    size_t target = (size_t)heap_mb << 20;
+    size_t nslots = target / (size_t)min_size + 1;
+    void **slots = mmap(NULL, nslots * sizeof(void *), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    size_t span = (size_t)(max_size - min_size + 1);
+    size_t n = 0;
+    for (size_t live = 0; live < target && n < nslots; n++) {
+        size_t size = (size_t)min_size + next_rand() % span;
+        slots[n] = malloc(size);
+        if (slots[n] == NULL) {
+            fprintf(stderr, "out of memory after %zu MB\n", live >> 20);
+            return 1;
+        }
+        live += size;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (next_rand() & 1) {
+            free(slots[i]);
+            slots[i] = NULL;
+        }
+    }
+
+    mm_stats_t before = {0};
+    if (mm_stats != NULL) {
+        mm_stats(&before);
+    }
+
+    size_t fits = 0;
+    double t0 = now_sec();
+    for (long op = 0; op < ops; op++) {
+        size_t i = next_rand() % n;
+        if (slots[i] != NULL) {
+            free(slots[i]);
+            slots[i] = NULL;
+        } else {
+            slots[i] = malloc((size_t)min_size + next_rand() % span);
+            fits++;
+        }
+    }
+    double elapsed = now_sec() - t0;
+
+    printf("%-8s %10s %10s %10s %12s %10s\n", "# fill_MB", "blocks", "ops", "ns/op",
+           "probes/fit", "heap_MB");
+    printf("%-9ld %10zu %10ld %10.1f", heap_mb, n, ops, elapsed * 1e9 / (double)ops);
+    if (mm_stats != NULL) {
+        mm_stats_t after;
+        mm_stats(&after);
+        printf(" %12.2f %10zu", (double)(after.fit_probes - before.fit_probes) / (double)fits,
+               after.heap_bytes >> 20);
+    }
+    printf("\n");
+    return 0;
+}
@@ -0,0 +1,452 @@
+/**
+ * @file replay.c
+ * @brief Replays allocation traces and reports per-operation latency
+ *
+ * Each trace is a `.rep` file in the driver's format: optional numeric
+ * header lines, then one operation per line:
+ *
+ *   a <id> <size>   allocate size bytes as block id
+ *   r <id> <size>   reallocate block id to size bytes
+ *   f <id>          free block id
+ *
+ * Recorded production traces use the same format. Lines starting with `#`
+ * are ignored.
+ *
+ * The program calls the standard malloc, realloc and free, so the allocator
+ * under test is picked when linking: with mm.c, with nothing (the C
+ * library's malloc), or by preloading another allocator. See compare.sh.
+ *
+ * For every trace, one untimed pass measures memory and the following
+ * passes time each operation on its own. Reported per trace:
+ *
+ *   - p50, p99 and p99.9 latency over all timed operations, in ns
+ *   - peak live bytes (sum of requested sizes) and peak heap bytes
+ *   - heap extensions during the untimed pass
+ *   - the process's peak resident set
+ *
+ * Heap bytes and extensions come from mm_stats, so they are only known
+ * when the allocator is mm.c; other allocators report just the peak RSS.
+ * The peak heap is sampled at every new peak of live bytes and at fixed
+ * operation intervals.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm_ext.h"
+
+/** @brief mm.c's statistics, or NULL with any other allocator */
+extern void mm_stats(mm_stats_t *stats) __attribute__((weak));
+
+/** @brief Kinds of trace operations */
+typedef enum { OP_ALLOC, OP_REALLOC, OP_FREE } op_kind_t;
+
+/** @brief One trace operation */
+typedef struct {
+    op_kind_t kind;
+    uint32_t id;
+    size_t size;
+} op_t;
+
+/** @brief A loaded trace */
+typedef struct {
+    const char *name;
+    op_t *ops;
+    size_t num_ops;
+    /** @brief One more than the largest block id */
+    size_t num_ids;
+} trace_t;
+
+/** @brief State of the blocks while a trace is replayed */
+typedef struct {
+    char **ptrs;
+    size_t *sizes;
+    size_t live_bytes;
+    size_t peak_live;
+    size_t peak_heap;
+} replay_t;
+
+/** @brief Default number of timed passes over each trace */
+static const int default_passes = 5;
+
+/**
+ * @brief Operations between heap samples in the untimed pass
+ *
+ * mm_stats locks every arena and copies every class's counters, so the
+ * heap is sampled at each new peak of live bytes and every this many
+ * operations rather than after each one.
+ */
+static const size_t stats_interval = 1024;
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds
+ */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Estimates the cost of one now_ns call
+ *
+ * Latencies include it; it is printed so it can be taken into account.
+ *
+ * @return The smallest difference seen between back-to-back calls, in ns
+ */
+static uint64_t timer_overhead(void) {
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < 10000; i++) {
+        uint64_t t0 = now_ns();
+        uint64_t t1 = now_ns();
+        if (t1 - t0 < best) {
+            best = t1 - t0;
+        }
+    }
+    return best;
+}
+
+/**
+ * @brief Reads the trace at path
+ *
+ * @param[in] path File to read
+ * @param[out] trace Receives the operations; trace->ops is malloc'd
+ * @return true on success, false (after printing why) on failure
+ */
+static bool load_trace(const char *path, trace_t *trace) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    size_t cap = 1024;
+    *trace = (trace_t){.name = path, .ops = malloc(cap * sizeof(op_t))};
+    char line[256];
+    size_t lineno = 0;
+    bool ok = trace->ops != NULL;
+
+    while (ok && fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        char kind;
+        unsigned long id;
+        size_t size = 0;
+        int n = sscanf(line, " %c %lu %zu", &kind, &id, &size);
+
+        // Header lines hold bare numbers
+        if (n <= 0 || kind == '#' || (kind >= '0' && kind <= '9')) {
+            continue;
+        }
+
+        op_t op = {.id = (uint32_t)id, .size = size};
+        if (kind == 'a' && n == 3) {
+            op.kind = OP_ALLOC;
+        } else if (kind == 'r' && n == 3) {
+            op.kind = OP_REALLOC;
+        } else if (kind == 'f' && n >= 2) {
+            op.kind = OP_FREE;
+        } else {
+            fprintf(stderr, "%s:%zu: bad operation\n", path, lineno);
+            ok = false;
+            break;
+        }
+        if (id >= UINT32_MAX) {
+            fprintf(stderr, "%s:%zu: block id too large\n", path, lineno);
+            ok = false;
+            break;
+        }
+
+        if (trace->num_ops == cap) {
+            cap *= 2;
+            op_t *ops = realloc(trace->ops, cap * sizeof(op_t));
+            if (ops == NULL) {
+                ok = false;
+                break;
+            }
+            trace->ops = ops;
+        }
+        trace->ops[trace->num_ops++] = op;
+        if (id + 1 > trace->num_ids) {
+            trace->num_ids = id + 1;
+        }
+    }
+
+    fclose(fp);
+    if (!ok) {
+        free(trace->ops);
+    }
+    return ok;
+}
+
+/**
+ * @brief Resets the process's peak resident set, where Linux allows it
+ */
+static void reset_peak_rss(void) {
+    FILE *fp = fopen("/proc/self/clear_refs", "w");
+    if (fp != NULL) {
+        fputs("5", fp);
+        fclose(fp);
+    }
+}
+
+/**
+ * @brief Returns the process's peak resident set in bytes, or 0 if unknown
+ */
+static size_t peak_rss(void) {
+    FILE *fp = fopen("/proc/self/status", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    char line[128];
+    size_t kb = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "VmHWM: %zu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+    return kb * 1024;
+}
+
+/**
+ * @brief Returns the bytes the allocator holds in its heaps and mappings
+ *
+ * @param[in] stats A snapshot from mm_stats
+ */
+static size_t heap_bytes(const mm_stats_t *stats) {
+    return stats->heap_bytes + stats->huge_bytes;
+}
+
+/**
+ * @brief Writes to the first and last byte of a block
+ *
+ * Every allocator then pays for faulting in the pages it hands out.
+ *
+ * @param[in] p The block
+ * @param[in] size Its size
+ */
+static void touch(char *p, size_t size) {
+    if (p != NULL && size > 0) {
+        p[0] = 1;
+        p[size - 1] = 1;
+    }
+}
+
+/**
+ * @brief Performs one trace operation
+ *
+ * @param[in] r Replay state
+ * @param[in] op The operation
+ * @return false if the allocator ran out of memory
+ */
+static bool run_op(replay_t *r, const op_t *op) {
+    char *p;
+
+    switch (op->kind) {
+    case OP_ALLOC:
+        p = malloc(op->size);
+        if (p == NULL && op->size > 0) {
+            return false;
+        }
+        touch(p, op->size);
+        r->ptrs[op->id] = p;
+        r->sizes[op->id] = op->size;
+        r->live_bytes += op->size;
+        break;
+    case OP_REALLOC:
+        p = realloc(r->ptrs[op->id], op->size);
+        if (p == NULL && op->size > 0) {
+            return false;
+        }
+        touch(p, op->size);
+        r->ptrs[op->id] = p;
+        r->live_bytes += op->size - r->sizes[op->id];
+        r->sizes[op->id] = op->size;
+        break;
+    case OP_FREE:
+        free(r->ptrs[op->id]);
+        r->ptrs[op->id] = NULL;
+        r->live_bytes -= r->sizes[op->id];
+        r->sizes[op->id] = 0;
+        break;
+    }
+    return true;
+}
+
+/**
+ * @brief Frees every block a pass left allocated
+ *
+ * @param[in] r Replay state
+ * @param[in] num_ids Number of block ids
+ */
+static void free_all(replay_t *r, size_t num_ids) {
+    for (size_t i = 0; i < num_ids; i++) {
+        free(r->ptrs[i]);
+        r->ptrs[i] = NULL;
+        r->sizes[i] = 0;
+    }
+    r->live_bytes = 0;
+}
+
+/**
+ * @brief Orders latencies for qsort
+ */
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Returns a percentile of sorted latencies
+ *
+ * @param[in] lat Latencies in ascending order
+ * @param[in] n Number of latencies, at least 1
+ * @param[in] pct Percentile between 0 and 100
+ */
+static uint32_t percentile(const uint32_t *lat, size_t n, double pct) {
+    size_t i = (size_t)(pct / 100.0 * (double)(n - 1) + 0.5);
+    return lat[i];
+}
+
+/**
+ * @brief Replays a trace and prints its result line
+ *
+ * @param[in] trace The trace
+ * @param[in] passes Number of timed passes
+ * @param[in] label Name of the allocator, for the result line
+ * @return false if the allocator ran out of memory
+ */
+static bool bench_trace(const trace_t *trace, int passes, const char *label) {
+    replay_t r = {
+        .ptrs = calloc(trace->num_ids, sizeof(char *)),
+        .sizes = calloc(trace->num_ids, sizeof(size_t)),
+    };
+    size_t num_lat = trace->num_ops * (size_t)passes;
+    uint32_t *lat = malloc((num_lat > 0 ? num_lat : 1) * sizeof(uint32_t));
+    if (r.ptrs == NULL || r.sizes == NULL || lat == NULL) {
+        fprintf(stderr, "%s: out of memory for the replay\n", trace->name);
+        free(r.ptrs);
+        free(r.sizes);
+        free(lat);
+        return false;
+    }
+
+    // Untimed pass: peak live bytes, peak heap and extensions
+    mm_stats_t before = {0};
+    mm_stats_t stats = {0};
+    if (mm_stats != NULL) {
+        mm_stats(&before);
+    }
+    reset_peak_rss();
+    bool ok = true;
+    for (size_t i = 0; ok && i < trace->num_ops; i++) {
+        ok = run_op(&r, &trace->ops[i]);
+        bool sample = (i + 1) % stats_interval == 0 || i + 1 == trace->num_ops;
+        if (r.live_bytes > r.peak_live) {
+            r.peak_live = r.live_bytes;
+            sample = true;
+        }
+        if (sample && mm_stats != NULL) {
+            mm_stats(&stats);
+            if (heap_bytes(&stats) > r.peak_heap) {
+                r.peak_heap = heap_bytes(&stats);
+            }
+        }
+    }
+    size_t rss = peak_rss();
+    free_all(&r, trace->num_ids);
+
+    // Timed passes
+    size_t k = 0;
+    for (int pass = 0; ok && pass < passes; pass++) {
+        for (size_t i = 0; ok && i < trace->num_ops; i++) {
+            uint64_t t0 = now_ns();
+            ok = run_op(&r, &trace->ops[i]);
+            uint64_t t1 = now_ns();
+            lat[k++] = (t1 - t0 > UINT32_MAX) ? UINT32_MAX : (uint32_t)(t1 - t0);
+        }
+        free_all(&r, trace->num_ids);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "%s: %s ran out of memory\n", trace->name, label);
+    } else if (k > 0) {
+        qsort(lat, k, sizeof(uint32_t), cmp_u32);
+        printf("%-10s %-24s %9zu %7" PRIu32 " %7" PRIu32 " %7" PRIu32 " %12zu",
+               label, trace->name, trace->num_ops, percentile(lat, k, 50),
+               percentile(lat, k, 99), percentile(lat, k, 99.9), r.peak_live);
+        if (mm_stats != NULL) {
+            double util = (r.peak_heap == 0) ? 0.0 : 100.0 * (double)r.peak_live / (double)r.peak_heap;
+            printf(" %12zu %5.1f%% %8zu", r.peak_heap, util, stats.extends - before.extends);
+        } else {
+            printf(" %12s %6s %8s", "-", "-", "-");
+        }
+        printf(" %12zu\n", rss);
+    }
+
+    free(r.ptrs);
+    free(r.sizes);
+    free(lat);
+    return ok;
+}
+
+/**
+ * @brief Prints the command line syntax
+ *
+ * @param[in] prog Name the program was run as
+ */
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-n passes] [-l label] trace.rep...\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int passes = default_passes;
+    const char *label = (mm_stats != NULL) ? "mm" : "libc";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:l:")) != -1) {
+        switch (opt) {
+        case 'n':
+            passes = atoi(optarg);
+            break;
+        case 'l':
+            label = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind == argc || passes < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    printf("# timer overhead %" PRIu64 " ns, included in latencies\n", timer_overhead());
+    printf("%-10s %-24s %9s %7s %7s %7s %12s %12s %6s %8s %12s\n",
+           "# alloc", "trace", "ops", "p50", "p99", "p99.9", "peak_live",
+           "peak_heap", "util", "extends", "peak_rss");
+
+    int status = 0;
+    for (int i = optind; i < argc; i++) {
+        trace_t trace;
+        if (!load_trace(argv[i], &trace)) {
+            status = 1;
+            continue;
+        }
+        if (!bench_trace(&trace, passes, label)) {
+            status = 1;
+        }
+        free(trace.ops);
+    }
+    return status;
+}
@@ -0,0 +1,520 @@
+/**
+ * @file stress.c
+ * @brief Multi-threaded stress and scalability benchmarks
+ *
+ * Each workload runs at 1, 2, 4, ... threads up to the maximum (which is
+ * included even if it is not a power of two). Every thread does the same
+ * number of operations, so perfect scaling keeps the wall time constant.
+ * Workloads:
+ *
+ *   larson    Threads replace random blocks in a set of slots. After each
+ *             round the sets move on to the next thread, so most frees
+ *             hit blocks another thread allocated.
+ *   prodcons  Each thread allocates into a ring consumed by the next
+ *             thread, which frees what it receives.
+ *   churn     Private random allocate/free at mixed sizes; nothing is
+ *             shared between threads.
+ *   xmalloc   Even threads allocate batches onto a shared stack and odd
+ *             threads free them.
+ *
+ * Every run reports throughput (mallocs plus frees per second), scaling
+ * efficiency relative to one thread, and peak RSS. With mm.c it also
+ * reports the share of arena lock acquisitions that had to wait, and how
+ * many frees went through remote-free queues (both from mm_stats). Like
+ * replay.c, the allocator is picked at link time.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mm_ext.h"
+
+/** @brief mm.c's statistics, or NULL with any other allocator */
+extern void mm_stats(mm_stats_t *stats) __attribute__((weak));
+
+/** @brief Slots per thread in larson */
+#define LARSON_SLOTS 1024
+/** @brief Rounds after which larson's slot sets move to the next thread */
+#define LARSON_ROUNDS 16
+/** @brief Pointers in a prodcons ring (a power of two) */
+#define RING_SIZE 1024
+/** @brief Blocks per xmalloc batch */
+#define BATCH_SIZE 64
+/** @brief Live blocks per churn thread */
+#define CHURN_SLOTS 4096
+
+/** @brief Per-thread state */
+typedef struct worker {
+    int id;
+    uint64_t rng;
+    /** @brief Mallocs and frees done */
+    size_t ops;
+    /** @brief When the thread started and finished its share, in seconds */
+    double start;
+    double end;
+} worker_t;
+
+/** @brief A single-producer single-consumer ring of payloads */
+typedef struct {
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    void *slots[RING_SIZE];
+} ring_t;
+
+/** @brief A batch of blocks on the xmalloc stack */
+typedef struct batch {
+    struct batch *next;
+    void *ptrs[BATCH_SIZE];
+} batch_t;
+
+/** @brief A workload: its name and what each thread runs */
+typedef struct {
+    const char *name;
+    void (*run)(worker_t *w);
+} workload_t;
+
+/** @brief Threads in the current run */
+static int nthreads;
+/** @brief Operations each thread does per run */
+static size_t iters;
+/** @brief Start line for the workers */
+static pthread_barrier_t start_barrier;
+/** @brief Round barrier for larson */
+static pthread_barrier_t round_barrier;
+
+/** @brief larson: one slot set per thread */
+static void *(*larson_sets)[LARSON_SLOTS];
+/** @brief prodcons: thread i consumes rings[i] and produces into the next */
+static ring_t *rings;
+/** @brief xmalloc: the shared stack of batches */
+static batch_t *batch_stack;
+static size_t batch_depth;
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int producers_left;
+/** @brief prodcons: threads still producing */
+static atomic_int rings_busy;
+
+/**
+ * @brief Returns the next value of a thread's xorshift generator
+ *
+ * @param[in] w The thread
+ */
+static uint64_t next_rand(worker_t *w) {
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    return w->rng;
+}
+
+/**
+ * @brief Returns a monotonic timestamp in seconds
+ */
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Returns a request size: mostly small, sometimes up to 8 KB
+ *
+ * @param[in] w The thread
+ */
+static size_t mixed_size(worker_t *w) {
+    uint64_t r = next_rand(w);
+    if ((r & 7) != 0) {
+        return 8 + (r >> 8) % 249;
+    }
+    return 257 + (r >> 8) % 7936;
+}
+
+/**
+ * @brief Allocates and writes the first byte, so the block is really used
+ *
+ * @param[in] w The calling thread
+ * @param[in] size Bytes to allocate
+ */
+static void *bench_malloc(worker_t *w, size_t size) {
+    char *p = malloc(size);
+    if (p == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    p[0] = (char)size;
+    w->ops++;
+    return p;
+}
+
+/**
+ * @brief Frees a block allocated by any thread
+ *
+ * @param[in] w The calling thread
+ * @param[in] p The block, or NULL
+ */
+static void bench_free(worker_t *w, void *p) {
+    if (p != NULL) {
+        free(p);
+        w->ops++;
+    }
+}
+
+static void run_larson(worker_t *w) {
+    int set = w->id;
+    size_t per_round = iters / 2 / LARSON_ROUNDS;
+
+    for (int round = 0; round < LARSON_ROUNDS; round++) {
+        void **slots = larson_sets[set];
+        for (size_t i = 0; i < per_round; i++) {
+            size_t k = next_rand(w) % LARSON_SLOTS;
+            bench_free(w, slots[k]);
+            slots[k] = bench_malloc(w, 8 + next_rand(w) % 505);
+        }
+        pthread_barrier_wait(&round_barrier);
+        set = (set + 1) % nthreads;
+    }
+}
+
+/**
+ * @brief Frees everything waiting in a ring
+ *
+ * @param[in] w The consuming thread
+ * @param[in] ring Its ring
+ */
+static void ring_drain(worker_t *w, ring_t *ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    while (head != tail) {
+        bench_free(w, ring->slots[head % RING_SIZE]);
+        head++;
+    }
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+}
+
+static void run_prodcons(worker_t *w) {
+    ring_t *in = &rings[w->id];
+    ring_t *out = &rings[(w->id + 1) % nthreads];
+
+    for (size_t i = 0; i < iters / 2; i++) {
+        void *p = bench_malloc(w, mixed_size(w));
+        size_t tail = atomic_load_explicit(&out->tail, memory_order_relaxed);
+        // Consume while the consumer of `out` is behind, so nobody deadlocks
+        while (tail - atomic_load_explicit(&out->head, memory_order_acquire) == RING_SIZE) {
+            ring_drain(w, in);
+            sched_yield();
+        }
+        out->slots[tail % RING_SIZE] = p;
+        atomic_store_explicit(&out->tail, tail + 1, memory_order_release);
+        if ((i & 15) == 15) {
+            ring_drain(w, in);
+        }
+    }
+    // The previous thread may still be waiting for room
+    atomic_fetch_sub(&rings_busy, 1);
+    while (atomic_load(&rings_busy) > 0) {
+        ring_drain(w, in);
+        sched_yield();
+    }
+    ring_drain(w, in);
+}
+
+static void run_churn(worker_t *w) {
+    void **slots = calloc(CHURN_SLOTS, sizeof(void *));
+    if (slots == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < iters / 2; i++) {
+        size_t k = next_rand(w) % CHURN_SLOTS;
+        bench_free(w, slots[k]);
+        slots[k] = bench_malloc(w, mixed_size(w));
+    }
+    for (size_t k = 0; k < CHURN_SLOTS; k++) {
+        bench_free(w, slots[k]);
+    }
+    free(slots);
+}
+
+/**
+ * @brief Pops a batch off the xmalloc stack and frees it
+ *
+ * @param[in] w The calling thread
+ * @return false if the stack was empty
+ */
+static bool batch_pop_free(worker_t *w) {
+    pthread_mutex_lock(&batch_lock);
+    batch_t *b = batch_stack;
+    if (b != NULL) {
+        batch_stack = b->next;
+        batch_depth--;
+    }
+    pthread_mutex_unlock(&batch_lock);
+
+    if (b == NULL) {
+        return false;
+    }
+    for (int i = 0; i < BATCH_SIZE; i++) {
+        bench_free(w, b->ptrs[i]);
+    }
+    free(b);
+    return true;
+}
+
+static void run_xmalloc(worker_t *w) {
+    bool producer = (w->id % 2 == 0);
+    size_t limit = (size_t)nthreads * 8;
+
+    if (producer) {
+        for (size_t n = 0; n < iters / 2; n += BATCH_SIZE) {
+            batch_t *b = malloc(sizeof(batch_t));
+            if (b == NULL) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+            for (int i = 0; i < BATCH_SIZE; i++) {
+                b->ptrs[i] = bench_malloc(w, mixed_size(w));
+            }
+            pthread_mutex_lock(&batch_lock);
+            b->next = batch_stack;
+            batch_stack = b;
+            size_t depth = ++batch_depth;
+            pthread_mutex_unlock(&batch_lock);
+            // Alone, or too far ahead of the freeing threads: free too
+            if (nthreads == 1 || depth > limit) {
+                batch_pop_free(w);
+            }
+        }
+        atomic_fetch_sub(&producers_left, 1);
+    }
+    while (batch_pop_free(w) || atomic_load(&producers_left) > 0) {
+        sched_yield();
+    }
+}
+
+static const workload_t workloads[] = {
+    {"larson", run_larson},
+    {"prodcons", run_prodcons},
+    {"churn", run_churn},
+    {"xmalloc", run_xmalloc},
+};
+
+static const size_t num_workloads = sizeof(workloads) / sizeof(workloads[0]);
+
+/**
+ * @brief Resets the process's peak resident set, where Linux allows it
+ */
+static void reset_peak_rss(void) {
+    FILE *fp = fopen("/proc/self/clear_refs", "w");
+    if (fp != NULL) {
+        fputs("5", fp);
+        fclose(fp);
+    }
+}
+
+/**
+ * @brief Returns the process's peak resident set in bytes, or 0 if unknown
+ */
+static size_t peak_rss(void) {
+    FILE *fp = fopen("/proc/self/status", "r");
+    if (fp == NULL) {
+        return 0;
+    }
+    char line[128];
+    size_t kb = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "VmHWM: %zu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+    return kb * 1024;
+}
+
+/** @brief Arguments of a worker thread */
+typedef struct {
+    const workload_t *load;
+    worker_t worker;
+} thread_arg_t;
+
+static void *thread_main(void *p) {
+    thread_arg_t *arg = p;
+    pthread_barrier_wait(&start_barrier);
+    arg->worker.start = now_sec();
+    arg->load->run(&arg->worker);
+    arg->worker.end = now_sec();
+    return NULL;
+}
+
+/**
+ * @brief Sets up the shared state of a workload for the current run
+ *
+ * @return false if memory for it ran out
+ */
+static bool setup_run(void) {
+    larson_sets = calloc((size_t)nthreads, sizeof(*larson_sets));
+    rings = calloc((size_t)nthreads, sizeof(ring_t));
+    batch_stack = NULL;
+    batch_depth = 0;
+    atomic_store(&producers_left, (nthreads + 1) / 2);
+    atomic_store(&rings_busy, nthreads);
+    pthread_barrier_init(&start_barrier, NULL, (unsigned)nthreads);
+    pthread_barrier_init(&round_barrier, NULL, (unsigned)nthreads);
+    return larson_sets != NULL && rings != NULL;
+}
+
+/**
+ * @brief Frees what a run left behind
+ *
+ * @param[in] w Any worker, to count the frees on
+ */
+static void teardown_run(worker_t *w) {
+    for (int t = 0; t < nthreads; t++) {
+        for (int k = 0; k < LARSON_SLOTS; k++) {
+            bench_free(w, larson_sets[t][k]);
+        }
+        ring_drain(w, &rings[t]);
+    }
+    while (batch_pop_free(w)) {
+    }
+    free(larson_sets);
+    free(rings);
+    pthread_barrier_destroy(&start_barrier);
+    pthread_barrier_destroy(&round_barrier);
+}
+
+/**
+ * @brief Runs a workload at the current thread count and prints its line
+ *
+ * @param[in] load The workload
+ * @param[in] base Throughput at one thread, or 0 if this is that run
+ * @return Throughput of this run in operations per second
+ */
+static double run_workload(const workload_t *load, double base) {
+    thread_arg_t *args = calloc((size_t)nthreads, sizeof(thread_arg_t));
+    pthread_t *threads = calloc((size_t)nthreads, sizeof(pthread_t));
+    if (args == NULL || threads == NULL || !setup_run()) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+
+    mm_stats_t before = {0};
+    mm_stats_t after = {0};
+    if (mm_stats != NULL) {
+        mm_stats(&before);
+    }
+    reset_peak_rss();
+
+    for (int t = 0; t < nthreads; t++) {
+        args[t].load = load;
+        args[t].worker = (worker_t){.id = t, .rng = 0x9e3779b97f4a7c15u * (uint64_t)(t + 1)};
+        pthread_create(&threads[t], NULL, thread_main, &args[t]);
+    }
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    // Wall time from the first thread starting to the last one finishing
+    size_t ops = 0;
+    double start = args[0].worker.start;
+    double end = args[0].worker.end;
+    for (int t = 0; t < nthreads; t++) {
+        ops += args[t].worker.ops;
+        start = (args[t].worker.start < start) ? args[t].worker.start : start;
+        end = (args[t].worker.end > end) ? args[t].worker.end : end;
+    }
+    double elapsed = end - start;
+    size_t rss = peak_rss();
+    if (mm_stats != NULL) {
+        mm_stats(&after);
+    }
+    teardown_run(&args[0].worker);
+
+    double tput = (double)ops / elapsed;
+    double eff = (base == 0) ? 1.0 : tput / (base * nthreads);
+    printf("%-10s %7d %10.2f %6.0f%% %10.1f", load->name, nthreads,
+           tput / 1e6, 100.0 * eff, (double)rss / (1 << 20));
+    if (mm_stats != NULL) {
+        size_t locks = after.locks - before.locks;
+        size_t waits = after.lock_waits - before.lock_waits;
+        printf(" %12zu %6.2f%% %12zu\n", locks,
+               (locks == 0) ? 0.0 : 100.0 * (double)waits / (double)locks,
+               after.remote_frees - before.remote_frees);
+    } else {
+        printf(" %12s %7s %12s\n", "-", "-", "-");
+    }
+
+    free(args);
+    free(threads);
+    return tput;
+}
+
+/**
+ * @brief Prints the command line syntax
+ *
+ * @param[in] prog Name the program was run as
+ */
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-t max_threads] [-i ops_per_thread] [workload...]\n", prog);
+    fprintf(stderr, "workloads:");
+    for (size_t i = 0; i < num_workloads; i++) {
+        fprintf(stderr, " %s", workloads[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv) {
+    long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    long ops_per_thread = 2000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:i:")) != -1) {
+        switch (opt) {
+        case 't':
+            max_threads = atol(optarg);
+            break;
+        case 'i':
+            ops_per_thread = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (max_threads < 1 || ops_per_thread < 2 * BATCH_SIZE) {
+        usage(argv[0]);
+        return 2;
+    }
+    iters = (size_t)ops_per_thread;
+
+    printf("%-10s %7s %10s %7s %10s %12s %7s %12s\n", "# workload", "threads",
+           "Mops/s", "eff", "peak_MB", "locks", "waits", "remote");
+    for (size_t i = 0; i < num_workloads; i++) {
+        const workload_t *load = &workloads[i];
+        bool wanted = (optind == argc);
+        for (int a = optind; a < argc; a++) {
+            wanted |= (strcmp(argv[a], load->name) == 0);
+        }
+        if (!wanted) {
+            continue;
+        }
+
+        double base = 0;
+        for (long n = 1; n <= max_threads; n = (n * 2 > max_threads && n < max_threads) ? max_threads : n * 2) {
+            nthreads = (int)n;
+            double tput = run_workload(load, base);
+            if (n == 1) {
+                base = tput;
+            }
+        }
+    }
+    return 0;
+}
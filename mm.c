@@ -20,21 +20,19 @@
  *
  * SEGREGATED FREE LIST ORGANIZATION:
  * ===================================
- * Free blocks are organized into NUM_CLASSES (10) size classes, where each
- * class maintains a doubly-linked list of free blocks within a size range:
- *
- *   Class 0: 32 bytes
- *   Class 1: 33-64 bytes
- *   Class 2: 65-128 bytes
- *   Class 3: 129-256 bytes
- *   Class 4: 257-512 bytes
- *   Class 5: 513-1024 bytes
- *   Class 6: 1025-2048 bytes
- *   Class 7: 2049-4096 bytes
- *   Class 8: 4097-8192 bytes
- *   Class 9: 8193+ bytes (all larger blocks)
- *
- * Each size class uses LIFO insertion.
+ * Free blocks are organized into NUM_CLASSES size classes, where each
+ * class maintains a doubly-linked list of free blocks within a size range.
+ * With the default four classes per power of two (MM_CLASS_BITS = 2):
+ *
+ *   Classes 0-3:   16, 32, 48, 64 bytes
+ *   Classes 4-7:   65-80, 81-96, 97-112, 113-128 bytes
+ *   Classes 8-11:  129-160, 161-192, 193-224, 225-256 bytes
+ *   ...
+ *   Classes 56-59: 524289-655360, ..., 917505-1048576 bytes
+ *   Class 60:      1048577+ bytes (all larger blocks)
+ *
+ * Free 16-byte blocks live on the separate mini list, so class 0 stays
+ * empty. Each size class uses LIFO insertion.
  *
  * HEAP STRUCTURE:
  * ===============
@@ -47,8 +45,269 @@
  * @author Joshua Smith <joshuas3@andrew.cmu.edu>
  */
 
+/*
+ * Build options. Each may be overridden on the compiler command line with
+ * -D<name>=<value>. The defaults keep the driver build single threaded.
+ *
+ *   MM_POLICY   Preset for the policy options below that are not given
+ *               explicitly: 0 keeps their defaults, 1 tunes for latency
+ *               (first fit, deferred coalescing), 2 tunes for memory
+ *               (exact best fit, minimal heap growth). Default 0.
+ *   MM_THREADS  Thread-safe build: per-thread caches in front of locked
+ *               segregated heaps. Default 0 under DRIVER, 1 otherwise.
+ *   MM_ARENAS   Number of independent heaps threads are spread across.
+ *               Values above 1 require MM_THREADS. Default 8 when
+ *               threaded, otherwise 1.
+ *   MM_CLASS_BITS
+ *               Size classes per power of two are 2^MM_CLASS_BITS
+ *               (0, 1 or 2). Default 2, so a block taken from a request's
+ *               own class is at most 25% larger than the request.
+ *   MM_SLAB_MAX Requests up to this many bytes (a multiple of 16, at most
+ *               512) are served from header-free slab runs. Sizes above
+ *               256 use multi-page runs. 0 disables slabs. Default 256.
+ *   MM_MMAP_THRESHOLD
+ *               Requests of at least this many bytes are mapped directly
+ *               from the OS and unmapped on free. 0 keeps everything in
+ *               the heap. Default 0 under DRIVER, otherwise 1 MB.
+ *   MM_DECAY_MS Pages of large free blocks left untouched for this many
+ *               milliseconds are returned to the OS, and the heap end is
+ *               trimmed where it can shrink. 0 never returns memory.
+ *               Default 0 under DRIVER, otherwise 1000.
+ *   MM_GROW_SHIFT
+ *               Each heap extension is at least 1/2^MM_GROW_SHIFT of the
+ *               current heap, so a growing heap needs O(log n) extensions.
+ *               0 extends by exactly what is needed (at least chunksize).
+ *               Default 0 under DRIVER, otherwise 3.
+ *   MM_GROW_MAX Upper bound on geometric extensions (bytes). Default 64 MB.
+ *   MM_QUICK_MAX
+ *               Freed blocks of up to this many bytes (a multiple of 16, at
+ *               most 2048) wait on per-size quick lists for reuse, and are
+ *               coalesced in batches. 0 coalesces on every free. Default 0.
+ *   MM_HUGE_PAGES
+ *               Back arena heaps with 2 MB pages: 1 asks for transparent
+ *               huge pages, 2 maps explicit (hugetlbfs) pages as the heap
+ *               grows, falling back to ordinary pages when the pool is
+ *               empty. Requires MM_ARENAS > 1. Default 0.
+ *   MM_NUMA_NODES
+ *               Split the arenas into this many equal sets, one per NUMA
+ *               node: each set's heaps prefer their node's memory and
+ *               threads allocate from the set of the node they run on.
+ *               0 ignores NUMA placement. Requires MM_ARENAS to be a
+ *               multiple of it. Default 0.
+ *   MM_PROF     Sampled heap profiling: a Poisson sample of allocations
+ *               records backtraces, written out by mm_prof_dump.
+ *               Requires MM_MMAP_THRESHOLD > 0. Default 0.
+ *   MM_PROF_SAMPLE
+ *               Mean number of bytes allocated between two samples.
+ *               Default 2 MB.
+ *   MM_TRACE    Events buffered per thread (a power of two) by the
+ *               hot-path tracing hooks, drained with mm_trace_drain.
+ *               0 compiles the hooks out. Default 0.
+ *   MM_FIT_SEARCH
+ *               Free blocks examined per size class for a best fit. 1 is
+ *               first fit; 0 searches whole classes, including the
+ *               request's own, for the exact best fit. Default 10.
+ *   MM_CHUNK_SIZE
+ *               Smallest heap extension, and the free space left at the
+ *               end of a trimmed heap (a multiple of 4096). Default 4096.
+ *   MM_SPLIT_MIN
+ *               Smallest remainder split off an allocated block as a free
+ *               block (a multiple of 16); smaller remainders stay with the
+ *               allocation. Default 16.
+ *   MM_NT_THRESHOLD
+ *               realloc copies and calloc fills of at least this many
+ *               bytes use non-temporal SSE2 stores, bypassing the cache.
+ *               Needs SSE2; 0 disables. Default 0 under DRIVER or without
+ *               SSE2, otherwise 4 MB.
+ */
+#ifndef MM_POLICY
+#define MM_POLICY 0
+#endif
+
+#if MM_POLICY == 1
+#ifndef MM_FIT_SEARCH
+#define MM_FIT_SEARCH 1
+#endif
+#ifndef MM_QUICK_MAX
+#define MM_QUICK_MAX 512
+#endif
+#elif MM_POLICY == 2
+#ifndef MM_FIT_SEARCH
+#define MM_FIT_SEARCH 0
+#endif
+#ifndef MM_GROW_SHIFT
+#define MM_GROW_SHIFT 0
+#endif
+#elif MM_POLICY != 0
+#error "MM_POLICY must be 0, 1 or 2"
+#endif
+
+#ifndef MM_THREADS
+#ifdef DRIVER
+#define MM_THREADS 0
+#else
+#define MM_THREADS 1
+#endif
+#endif
+
+#ifndef MM_ARENAS
+#if MM_THREADS
+#define MM_ARENAS 8
+#else
+#define MM_ARENAS 1
+#endif
+#endif
+
+#ifndef MM_CLASS_BITS
+#define MM_CLASS_BITS 2
+#endif
+
+#if MM_CLASS_BITS < 0 || MM_CLASS_BITS > 2
+#error "MM_CLASS_BITS must be 0, 1 or 2"
+#endif
+
+#ifndef MM_SLAB_MAX
+#define MM_SLAB_MAX 256
+#endif
+
+#if MM_SLAB_MAX < 0 || MM_SLAB_MAX > 512 || MM_SLAB_MAX % 16 != 0
+#error "MM_SLAB_MAX must be a multiple of 16 between 0 and 512"
+#endif
+
+#ifndef MM_MMAP_THRESHOLD
+#ifdef DRIVER
+#define MM_MMAP_THRESHOLD 0
+#else
+#define MM_MMAP_THRESHOLD (1 << 20)
+#endif
+#endif
+
+#ifndef MM_DECAY_MS
+#ifdef DRIVER
+#define MM_DECAY_MS 0
+#else
+#define MM_DECAY_MS 1000
+#endif
+#endif
+
+#ifndef MM_GROW_SHIFT
+#ifdef DRIVER
+#define MM_GROW_SHIFT 0
+#else
+#define MM_GROW_SHIFT 3
+#endif
+#endif
+
+#ifndef MM_GROW_MAX
+#define MM_GROW_MAX (1 << 26)
+#endif
+
+#ifndef MM_QUICK_MAX
+#define MM_QUICK_MAX 0
+#endif
+
+#if MM_QUICK_MAX < 0 || MM_QUICK_MAX > 2048 || MM_QUICK_MAX % 16 != 0
+#error "MM_QUICK_MAX must be a multiple of 16 between 0 and 2048"
+#endif
+
+#ifndef MM_HUGE_PAGES
+#define MM_HUGE_PAGES 0
+#endif
+
+#if MM_HUGE_PAGES < 0 || MM_HUGE_PAGES > 2
+#error "MM_HUGE_PAGES must be 0, 1 or 2"
+#endif
+
+#if MM_ARENAS > 1 && !MM_THREADS
+#error "MM_ARENAS > 1 requires MM_THREADS"
+#endif
+
+#if MM_HUGE_PAGES && MM_ARENAS == 1
+#error "MM_HUGE_PAGES requires MM_ARENAS > 1"
+#endif
+
+#ifndef MM_NUMA_NODES
+#define MM_NUMA_NODES 0
+#endif
+
+#if MM_NUMA_NODES < 0 || MM_NUMA_NODES > 64 || \
+    (MM_NUMA_NODES > 1 && MM_ARENAS % MM_NUMA_NODES != 0)
+#error "MM_NUMA_NODES must be at most 64 and divide MM_ARENAS"
+#endif
+
+#ifndef MM_PROF
+#define MM_PROF 0
+#endif
+
+#ifndef MM_PROF_SAMPLE
+#define MM_PROF_SAMPLE (1 << 21)
+#endif
+
+#if MM_PROF_SAMPLE <= 0
+#error "MM_PROF_SAMPLE must be positive"
+#endif
+
+#if MM_PROF && MM_MMAP_THRESHOLD == 0
+#error "MM_PROF requires MM_MMAP_THRESHOLD > 0"
+#endif
+
+#ifndef MM_TRACE
+#define MM_TRACE 0
+#endif
+
+#if MM_TRACE < 0 || (MM_TRACE & (MM_TRACE - 1)) != 0
+#error "MM_TRACE must be 0 or a power of two"
+#endif
+
+#ifndef MM_FIT_SEARCH
+#define MM_FIT_SEARCH 10
+#endif
+
+#if MM_FIT_SEARCH < 0
+#error "MM_FIT_SEARCH must not be negative"
+#endif
+
+#ifndef MM_CHUNK_SIZE
+#define MM_CHUNK_SIZE (1 << 12)
+#endif
+
+#if MM_CHUNK_SIZE <= 0 || MM_CHUNK_SIZE % 4096 != 0
+#error "MM_CHUNK_SIZE must be a positive multiple of 4096"
+#endif
+
+#ifndef MM_SPLIT_MIN
+#define MM_SPLIT_MIN 16
+#endif
+
+#if MM_SPLIT_MIN < 16 || MM_SPLIT_MIN % 16 != 0
+#error "MM_SPLIT_MIN must be a multiple of 16, at least 16"
+#endif
+
+#ifndef MM_NT_THRESHOLD
+#if defined(DRIVER) || !defined(__SSE2__)
+#define MM_NT_THRESHOLD 0
+#else
+#define MM_NT_THRESHOLD (1 << 22)
+#endif
+#endif
+
+#if MM_NT_THRESHOLD < 0
+#error "MM_NT_THRESHOLD must not be negative"
+#endif
+
+#if MM_NT_THRESHOLD > 0 && !defined(__SSE2__)
+#error "MM_NT_THRESHOLD requires SSE2"
+#endif
+
+#if (MM_THREADS || MM_MMAP_THRESHOLD > 0 || MM_DECAY_MS > 0) && \
+    !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* sched_getcpu, mremap, madvise */
+#endif
+
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -56,8 +315,35 @@
 #include <string.h>
 #include <unistd.h>
 
+#if MM_THREADS
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#endif
+#if MM_TRACE > 0
+#include <stdatomic.h>
+#endif
+#if MM_ARENAS > 1 || MM_MMAP_THRESHOLD > 0 || MM_DECAY_MS > 0 || MM_TRACE > 0
+#include <sys/mman.h>
+#endif
+#if MM_DECAY_MS > 0 || MM_TRACE > 0
+#include <time.h>
+#endif
+#if MM_NUMA_NODES > 1
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#endif
+#if MM_PROF
+#include <execinfo.h>
+#include <fcntl.h>
+#endif
+#if MM_NT_THRESHOLD > 0
+#include <emmintrin.h>
+#endif
+
 #include "memlib.h"
 #include "mm.h"
+#include "mm_ext.h"
 
 /* Do not change the following! */
 
@@ -67,6 +353,9 @@
 #define free mm_free
 #define realloc mm_realloc
 #define calloc mm_calloc
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
 #define memset mem_memset
 #define memcpy mem_memcpy
 #endif /* def DRIVER */
@@ -123,10 +412,31 @@ static const size_t dsize = 2 * wsize;
 static const size_t min_block_size = 2 * dsize;
 
 /**
- * TODO: explain what chunksize is
+ * @brief Smallest heap extension (bytes)
  * (Must be divisible by dsize)
  */
-static const size_t chunksize = (1 << 12);
+static const size_t chunksize = MM_CHUNK_SIZE;
+
+/** @brief Smallest remainder split off an allocated block as a free block (bytes) */
+static const size_t split_min_size = MM_SPLIT_MIN;
+
+/** @brief Free blocks examined per size class by a best-fit search */
+static const int max_search = (MM_FIT_SEARCH > 0) ? MM_FIT_SEARCH : INT_MAX;
+
+/** @brief Whether the request's own class is searched for the best fit too */
+static const bool exact_fit = (MM_FIT_SEARCH == 0);
+
+/**
+ * @brief Size of the pages backing arena heaps (bytes)
+ *
+ * Heap extensions end on, and purges and trims only release, whole pages
+ * of this size, so a huge page is never split.
+ */
+#if MM_HUGE_PAGES
+static const size_t heap_page_size = (1 << 21);
+#elif MM_ARENAS > 1 || MM_DECAY_MS > 0
+static const size_t heap_page_size = (1 << 12);
+#endif
 
 /**
  * TODO: explain what alloc_mask is
@@ -135,6 +445,19 @@ static const word_t alloc_mask = 0x1;
 static const word_t prev_alloc_mask = 0x2;
 static const word_t prev_mini_mask = 0x4;
 
+/**
+ * @brief Marks the header of a free mini block on the mini list
+ *
+ * A mini block is always mb_block_size bytes, so while it sits on the mini
+ * list its header's size field instead holds the (16-byte aligned) payload
+ * address of its predecessor on the list. This gives the list O(1) unlinking while
+ * keeping mini blocks at 16 bytes.
+ */
+static const word_t mini_link_mask = 0x8;
+
+/** @brief The alloc, prev_alloc and prev_mini bits of a header */
+static const word_t flag_mask = 0x7;
+
 /**
  * TODO: explain what size_mask is
  */
@@ -149,24 +472,178 @@ typedef struct block {
             struct block *next;
             struct block *prev;
         };
+        /** @brief Children of a free block in the large-block tree */
+        struct {
+            struct block *left;
+            struct block *right;
+        };
     };
 } block_t;
 
 static word_t *header_to_footer(block_t *block);
 static bool get_alloc(block_t *block);
 static bool get_mini(block_t *block);
+static bool create_heap(void);
+static void clear_heap(void);
+static bool init_heap(void);
+static void mark_dirty(block_t *block);
+static void free_block(block_t *block);
 
-/** @brief Pointer to first block in the heap */
-static block_t *heap_start = NULL;
-//static block_t *free_list_head = NULL;
+/**
+ * @brief Sizes above 2^CLASS_MAX_LOG bytes all share the last size class
+ */
+#define CLASS_MAX_LOG 20
 
-#define NUM_CLASSES 15
-static block_t *size_class[NUM_CLASSES];
+/**
+ * @brief Number of segregated size classes (see size_to_class)
+ *
+ * 2^MM_CLASS_BITS classes for the linear range up to 2^(4+MM_CLASS_BITS),
+ * as many for each power of two from there to 2^CLASS_MAX_LOG, and one
+ * class for everything larger.
+ */
+#define NUM_CLASSES \
+    ((1 << MM_CLASS_BITS) * (CLASS_MAX_LOG - 3 - MM_CLASS_BITS) + 1)
 
 static const size_t mb_block_size = 16;
 static const size_t mb_dsize = 8;
 
-static block_t *mini_block_head = NULL;
+/** @brief Number of quick lists (block sizes 16, 32, ..., MM_QUICK_MAX) */
+#define QUICK_BINS (MM_QUICK_MAX / 16)
+
+/** @brief Number of slab object sizes (16, 32, ..., MM_SLAB_MAX bytes) */
+#define SLAB_CLASSES (MM_SLAB_MAX / 16)
+
+/**
+ * @brief Number of leaves in an arena's slab page map
+ *
+ * Each leaf maps slab_leaf_pages pages of slab_page_size bytes, so the
+ * map covers the first 64 GB of an arena's heap.
+ */
+#define SLAB_MAP_DIRS 4096
+
+struct slab_run;
+
+/**
+ * @brief Running statistics of one arena, reported by mm_stats
+ *
+ * Every field is updated under the arena lock, so keeping them costs a
+ * plain increment on a cache line the heap routines already own. List
+ * lengths and byte counts describe the heap as it is now; the rest count
+ * events since the heap was created.
+ */
+typedef struct arena_stats {
+    /** @brief Blocks and slab objects handed out and taken back, by size class */
+    size_t mallocs[NUM_CLASSES];
+    size_t frees[NUM_CLASSES];
+    /** @brief Blocks on each size class list, in the tree and on the mini list */
+    size_t class_blocks[NUM_CLASSES];
+    size_t tree_blocks;
+    size_t mini_blocks;
+    /** @brief Bytes of all listed free blocks */
+    size_t free_bytes;
+    /** @brief Bytes of free objects in partial and spare slab runs */
+    size_t slab_free_bytes;
+    /** @brief Thread cache hits and frees, folded in when a thread locks the arena */
+    size_t tcache_hits;
+    size_t tcache_frees;
+    size_t extends;
+    size_t splits;
+    size_t coalesces;
+    /** @brief Free blocks and tree nodes examined while searching for a fit */
+    size_t fit_probes;
+    /** @brief Times the arena lock was taken, and taken only after waiting */
+    size_t locks;
+    size_t lock_waits;
+    /** @brief Payloads freed by other threads and drained from remote_frees */
+    size_t remote_frees;
+} arena_stats_t;
+
+/**
+ * @brief One independent segregated heap
+ *
+ * Each arena owns a contiguous heap with its own prologue and epilogue, so
+ * coalescing never crosses arenas. With a single arena the heap is the one
+ * grown through mem_sbrk; with several, each arena carves its heap from its
+ * own arena_span-sized slice of one up-front virtual reservation, so the
+ * arena owning a block is found from its address alone.
+ */
+typedef struct arena {
+    /** @brief Pointer to first block in the heap, or NULL before init */
+    block_t *heap_start;
+    block_t *size_class[NUM_CLASSES];
+    /** @brief Root of the tree of free blocks of at least tree_min_size */
+    block_t *tree;
+    /** @brief Bit i is set exactly when size_class[i] is non-empty */
+    uint64_t class_map;
+    block_t *mini_block_head;
+    arena_stats_t stats;
+#if MM_QUICK_MAX > 0
+    /** @brief Freed blocks awaiting reuse, linked through block->next */
+    block_t *quick[QUICK_BINS];
+    /** @brief Number of blocks on all quick lists */
+    unsigned quick_count;
+#endif
+#if MM_SLAB_MAX > 0
+    /** @brief Runs of each object size with at least one free object */
+    struct slab_run *slab_partial[SLAB_CLASSES];
+    /** @brief One empty run kept back so a hot size does not thrash */
+    struct slab_run *slab_spare;
+    /** @brief Page map leaves marking which pages are slab runs */
+    uint64_t *slab_map[SLAB_MAP_DIRS];
+#endif
+#if MM_ARENAS > 1
+    /** @brief Bounds of this arena's reserved slice and its current break */
+    char *lo;
+    char *brk;
+    char *end;
+#if MM_HUGE_PAGES == 2
+    /** @brief End of the part of the slice offered to explicit huge pages */
+    char *committed;
+#endif
+#endif
+#if MM_DECAY_MS > 0
+    /** @brief Number of the next purge pass; stamps dirty free blocks */
+    uint64_t purge_gen;
+    /** @brief Time of the last purge pass (ms, CLOCK_MONOTONIC) */
+    uint64_t purge_last_ms;
+#endif
+#if MM_THREADS
+    pthread_mutex_t lock;
+    /** @brief Payloads freed by other threads, linked through their first word */
+    _Atomic(void *) remote_frees;
+#endif
+#if MM_NUMA_NODES > 1
+    /** @brief Remote frees made by threads running on another node */
+    atomic_size_t cross_node_frees;
+#endif
+} arena_t;
+
+static arena_t arenas[MM_ARENAS];
+
+#if MM_ARENAS > 1
+/** @brief Virtual address space reserved per arena (bytes) */
+static const size_t arena_span = (size_t)1 << 36;
+
+/** @brief Start of the reservation holding every arena's heap */
+static char *arena_base = NULL;
+#endif
+
+#if MM_NUMA_NODES > 1
+/** @brief Number of arenas in each NUMA node's set */
+#define ARENAS_PER_NODE (MM_ARENAS / MM_NUMA_NODES)
+#endif
+
+/**
+ * @brief The arena all heap routines operate on
+ *
+ * Set by lock_arena; in threaded builds it is per thread and names the
+ * arena whose lock that thread holds.
+ */
+#if MM_THREADS
+static _Thread_local arena_t *arena = &arenas[0];
+#else
+static arena_t *arena = &arenas[0];
+#endif
 /*
  *****************************************************************************
  * The functions below are short wrapper functions to perform                *
@@ -207,6 +684,138 @@ static size_t round_up(size_t size, size_t n) {
     return n * ((size + (n - 1)) / n);
 }
 
+#if MM_NUMA_NODES > 1
+/**
+ * @brief Asks for part of an arena's slice to be backed by its node's memory
+ *
+ * MPOL_PREFERRED still falls back to other nodes when the local one is
+ * full, and the call simply fails on machines with fewer nodes.
+ *
+ * @param[in] lo First byte, page aligned, inside one arena's slice
+ * @param[in] len Number of bytes
+ */
+static void bind_pages(char *lo, size_t len) {
+    size_t node = (size_t)(lo - arena_base) / arena_span / ARENAS_PER_NODE;
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, lo, len, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0);
+}
+#elif MM_ARENAS > 1
+static void bind_pages(char *lo, size_t len) {
+    (void)lo;
+    (void)len;
+}
+#endif
+
+#if MM_HUGE_PAGES == 2
+/**
+ * @brief Maps explicit huge pages under the current arena's new break
+ *
+ * The slice past the old commit point has never been touched, so it can
+ * be replaced wholesale. If the huge page pool cannot cover it, it stays
+ * (or is mapped again as) ordinary pages.
+ */
+static void commit_huge_pages(void) {
+    char *end = (char *)round_up((uintptr_t)arena->brk, heap_page_size);
+    size_t len = (size_t)(end - arena->committed);
+    void *p = mmap(arena->committed, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0);
+    if (p == MAP_FAILED) {
+        mmap(arena->committed, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+    }
+    // A new mapping starts without the slice's memory policy
+    bind_pages(arena->committed, len);
+    arena->committed = end;
+}
+#endif
+
+/**
+ * @brief Grows the current arena's heap.
+ *
+ * With a single arena this is mem_sbrk; otherwise the break moves within
+ * the arena's reserved slice.
+ *
+ * @param[in] incr Number of bytes to add
+ * @return The old break, or (void *)-1 if the heap cannot grow
+ */
+static void *arena_sbrk(size_t incr) {
+#if MM_ARENAS > 1
+    if (incr > (size_t)(arena->end - arena->brk)) {
+        return (void *)-1;
+    }
+    char *old = arena->brk;
+    arena->brk += incr;
+#if MM_HUGE_PAGES == 2
+    if (arena->brk > arena->committed) {
+        commit_huge_pages();
+    }
+#endif
+    return old;
+#else
+    return mem_sbrk((intptr_t)incr);
+#endif
+}
+
+/**
+ * @brief Whether memory returned by arena_sbrk reads as zero
+ *
+ * An arena's slice is anonymous memory above its break that is only ever
+ * handed back purged (see trim_heap and reset_arenas). mem_sbrk makes no
+ * such promise: the driver reuses its heap between traces.
+ */
+static const bool sbrk_zeroed = MM_ARENAS > 1;
+
+#if MM_ARENAS > 1 || MM_DECAY_MS > 0
+/**
+ * @brief Returns whole heap pages to the OS; they read as zero afterwards
+ *
+ * Explicit huge pages are not reliably dropped by madvise, so fresh
+ * ordinary pages are mapped over them instead.
+ *
+ * @param[in] lo First byte, aligned to heap_page_size
+ * @param[in] len Number of bytes
+ * @return true if the pages were released
+ */
+static bool release_pages(char *lo, size_t len) {
+#if MM_HUGE_PAGES == 2
+    if (mmap(lo, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED) {
+        return false;
+    }
+    bind_pages(lo, len);
+    return true;
+#else
+    return madvise(lo, len, MADV_DONTNEED) == 0;
+#endif
+}
+#endif
+
+/**
+ * @brief Returns the first byte of an arena's heap.
+ * @param[in] a The arena
+ */
+static void *arena_heap_lo(const arena_t *a) {
+#if MM_ARENAS > 1
+    return a->lo;
+#else
+    (void)a;
+    return mem_heap_lo();
+#endif
+}
+
+/**
+ * @brief Returns the last byte of an arena's heap.
+ * @param[in] a The arena
+ */
+static void *arena_heap_hi(const arena_t *a) {
+#if MM_ARENAS > 1
+    return a->brk - 1;
+#else
+    (void)a;
+    return mem_heap_hi();
+#endif
+}
+
 /**
  * @brief Returns the allocation status of a given header value.
  *
@@ -269,12 +878,16 @@ static void set_prev_alloc(block_t *block){
  * @brief Extracts the size represented in a packed word.
  *
  * This function simply clears the lowest 4 bits of the word, as the heap
- * is 16-byte aligned.
+ * is 16-byte aligned. Headers of listed mini blocks carry a list link in
+ * place of their size, which is implicitly mb_block_size.
  *
  * @param[in] word
  * @return The size of the block represented by the word
  */
 static size_t extract_size(word_t word) {
+    if (word & mini_link_mask) {
+        return mb_block_size;
+    }
     return (word & size_mask);
 }
 
@@ -442,7 +1055,7 @@ static size_t get_payload_size(block_t *block) {
  */
 static void write_epilogue(block_t *block) {
     dbg_requires(block != NULL);
-    dbg_requires((char *)block == (char *)mem_heap_hi() - 7);
+    dbg_requires((char *)block == (char *)arena_heap_hi(arena) - 7);
     block->header = pack(0, true, false, false);
 }
 
@@ -550,361 +1163,3625 @@ static block_t *find_prev(block_t *block) {
 /******** The remaining content below are helper and debug routines ********/
 
 /**
- * @brief Maps block size to size class index using power-of-2 ranges
+ * @brief Maps block size to size class index
+ *
+ * With k = MM_CLASS_BITS, sizes up to 2^(4+k) get one class per 16 bytes.
+ * Above that each power-of-two range (2^p, 2^(p+1)] is split into 2^k
+ * equal sub-ranges: the class is built from the bit length of size - 1
+ * (which range) and the k bits below its leading bit (which sub-range).
+ * Everything above 2^CLASS_MAX_LOG shares the last class.
  *
  * @param[in] size The size of the block in bytes
  * @return The size class index (0 to NUM_CLASSES-1)
  */
 static int size_to_class(size_t size){
-    if (size <= 32)      return 0;
-    if (size <= 64)      return 1;
-    if (size <= 128)     return 2;
-    if (size <= 256)     return 3;
-    if (size <= 512)     return 4;
-    if (size <= 1024)    return 5;
-    if (size <= 2048)    return 6;
-    if (size <= 4096)    return 7;
-    if (size <= 8192)    return 8;
-    if (size <= 16384)   return 9;
-    if (size <= 32768)   return 10;
-    if (size <= 65536)   return 11;
-    if (size <= 131072)  return 12;
-    if (size <= 262144)  return 13;
-    else                 return 14;
+    size_t x = size - 1;
+    if (x < ((size_t)16 << MM_CLASS_BITS)) {
+        return (int)(x >> 4);
+    }
+
+    int p = 63 - __builtin_clzll((unsigned long long)x);
+    int sub = (int)(x >> (p - MM_CLASS_BITS)) & ((1 << MM_CLASS_BITS) - 1);
+    int class = ((p - 3 - MM_CLASS_BITS) << MM_CLASS_BITS) + sub;
+    return (class < NUM_CLASSES - 1) ? class : NUM_CLASSES - 1;
 }
 
 /**
- * @brief Inserts a free block at head of its size class list (LIFO)
+ * @brief Returns the smallest block size in a size class
  *
- * @param[in] block Pointer to the free block to insert
+ * The inverse of size_to_class, used to label classes in statistics.
+ *
+ * @param[in] class A size class index (0 to NUM_CLASSES-1)
+ * @return The smallest size mapping to `class`
  */
-static void add_to_free_list(block_t *block){
-    dbg_requires(block != NULL);
-    dbg_requires(!get_alloc(block));
-
-    int class = size_to_class(get_size(block));
-
-    block->next = size_class[class];
-    block->prev = NULL;
-
-    if (size_class[class] != NULL) {
-        size_class[class]->prev = block;
+static size_t class_min_size(int class) {
+    if (class < (1 << MM_CLASS_BITS)) {
+        return (size_t)class * 16 + 1;
     }
-    
-    size_class[class] = block;
+    int p = (class >> MM_CLASS_BITS) + 3 + MM_CLASS_BITS;
+    int sub = class & ((1 << MM_CLASS_BITS) - 1);
+    return ((size_t)1 << p) + ((size_t)sub << (p - MM_CLASS_BITS)) + 1;
 }
 
+/** @brief Room for a class's size range: two 20-digit sizes, a dash and a NUL */
+#define CLASS_RANGE_LEN 48
+
 /**
- * @brief Removes a free block from its size class list
+ * @brief Formats the sizes a class holds, as "lo-hi", or "lo+" for the last
  *
- * @param[in] block Pointer to the free block to remove
+ * @param[out] buf Buffer of CLASS_RANGE_LEN bytes
+ * @param[in] class The size class
+ * @return buf
  */
-static void rem_from_free_list(block_t *block){
-    dbg_requires(block != NULL);
-    dbg_requires(!get_alloc(block));
-
-    block_t *old_prev = block -> prev;
-    block_t *old_next = block -> next;
-
-    int class = size_to_class(get_size(block));    
-
-    if(old_prev == NULL && old_next == NULL){
-        // NULL <-> __block__ <-> NULL
-        size_class[class] = NULL;
-    } else if(old_prev != NULL && old_next != NULL){
-        // block <-> __block__ <-> block
-        old_prev -> next = old_next;
-        old_next -> prev = old_prev;
-    } else if(old_prev != NULL && old_next == NULL){
-        // block <-> __block__ <-> NULL
-        old_prev -> next = NULL;
-    } else if(old_prev == NULL && old_next != NULL){
-        // NULL <-> __block__ <-> block
-        old_next -> prev = NULL;
-        size_class[class] = old_next;
+static const char *class_range(char *buf, int class) {
+    if (class + 1 < NUM_CLASSES) {
+        snprintf(buf, CLASS_RANGE_LEN, "%zu-%zu",
+                 class_min_size(class), class_min_size(class + 1) - 1);
+    } else {
+        snprintf(buf, CLASS_RANGE_LEN, "%zu+", class_min_size(class));
     }
+    return buf;
 }
 
 /**
- * @brief Removes a free mini block from the mini block free list
- * 
- * This function searches for and unlinks the specified block from the
- * singly-linked mini block free list. If the block is at the head,
- * it updates the head pointer. Otherwise, it searches the list and
- * unlinks the block from its predecessor.
- *
- * @param[in] block Pointer to the mini block to remove
- * @pre block must be free, mini, and in the mini_block_head list
+ * @brief Counts a block or slab object handed out by the current arena
+ * @param[in] size Size of the block or object
  */
-static void rem_from_mini_list(block_t *block){
-    dbg_requires(block != NULL);
-    dbg_requires(mini_block_head != NULL);
-    dbg_requires(!get_alloc(block));
-    dbg_requires(get_mini(block));
+static void count_malloc(size_t size) {
+    arena->stats.mallocs[size_to_class(size)]++;
+}
+
+/**
+ * @brief Counts a block or slab object returned to the current arena
+ * @param[in] size Size of the block or object
+ */
+static void count_free(size_t size) {
+    arena->stats.frees[size_to_class(size)]++;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *                             HOT-PATH TRACING
+ * ---------------------------------------------------------------------------
+ *
+ * With MM_TRACE, every thread appends events to a ring of MM_TRACE slots
+ * that only it writes, and mm_trace_drain empties the rings from any one
+ * thread. head and tail are the only words the two sides share: the writer
+ * publishes an event by advancing head, the reader frees slots by
+ * advancing tail, so neither waits for the other. A full ring drops new
+ * events and counts them. Rings are mapped from the OS, because the hooks
+ * run inside malloc; they stay on a list that never shrinks and pass to a
+ * new thread once their owner exits.
+ */
+
+#if MM_TRACE > 0
+
+/** @brief One thread's event ring */
+typedef struct trace_ring {
+    /** @brief Next ring on trace_rings */
+    struct trace_ring *next;
+    /** @brief Set while a thread writes to the ring */
+    atomic_bool owned;
+    uint16_t id;
+    /** @brief Events written and events drained, counted from ring creation */
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_size_t dropped;
+    mm_trace_event_t events[MM_TRACE];
+} trace_ring_t;
+
+/** @brief Every ring ever created */
+static _Atomic(trace_ring_t *) trace_rings = NULL;
+static atomic_uint trace_next_id = 0;
+/** @brief Bit op is set while events of that op are recorded */
+static atomic_uint trace_ops = MM_TRACE_ALL;
+/** @brief Set while a thread is draining */
+static atomic_flag trace_draining = ATOMIC_FLAG_INIT;
+
+#if MM_THREADS
+static _Thread_local trace_ring_t *trace_ring = NULL;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+
+/**
+ * @brief Gives up the exiting thread's ring, so another thread can take it
+ *
+ * Installed as the trace_key destructor.
+ *
+ * @param[in] arg The exiting thread's ring
+ */
+static void trace_release(void *arg) {
+    trace_ring_t *ring = arg;
+    trace_ring = NULL;
+    atomic_store_explicit(&ring->owned, false, memory_order_release);
+}
+
+static void trace_setup(void) {
+    pthread_key_create(&trace_key, trace_release);
+}
+#else
+static trace_ring_t *trace_ring = NULL;
+#endif
+
+/**
+ * @brief Gives the calling thread a ring: one left by an exited thread, or
+ *        a new one
+ *
+ * @return The ring, or NULL if no memory could be mapped for it
+ */
+static trace_ring_t *trace_claim(void) {
+    trace_ring_t *ring;
+    for (ring = atomic_load(&trace_rings); ring != NULL; ring = ring->next) {
+        bool owned = false;
+        if (atomic_compare_exchange_strong(&ring->owned, &owned, true)) {
+            break;
+        }
+    }
 
-    if (block == mini_block_head) {
-        mini_block_head = mini_block_head->next;
+    if (ring == NULL) {
+        ring = mmap(NULL, sizeof(trace_ring_t), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ring == MAP_FAILED) {
+            return NULL;
+        }
+        atomic_init(&ring->owned, true);
+        ring->id = (uint16_t)atomic_fetch_add(&trace_next_id, 1);
+        ring->next = atomic_load(&trace_rings);
+        while (!atomic_compare_exchange_weak(&trace_rings, &ring->next, ring)) {
+        }
+    }
+
+    // Set first: registering the key may allocate, and so trace
+    trace_ring = ring;
+#if MM_THREADS
+    pthread_once(&trace_once, trace_setup);
+    pthread_setspecific(trace_key, ring);
+#endif
+    return ring;
+}
+
+/**
+ * @brief Records an event in the calling thread's ring
+ *
+ * @param[in] op The mm_trace_op
+ * @param[in] size Bytes involved, as documented for the op
+ * @param[in] probes Blocks examined or merged, as documented for the op
+ */
+static void trace_event(unsigned op, size_t size, size_t probes) {
+    if (!((atomic_load_explicit(&trace_ops, memory_order_relaxed) >> op) & 1)) {
         return;
     }
 
-    block_t *current = mini_block_head;
-    while (current != NULL && current->next != block) {
-        current = current->next;
+    trace_ring_t *ring = trace_ring;
+    if (ring == NULL && (ring = trace_claim()) == NULL) {
+        return;
     }
-    
-    if (current != NULL && current->next == block) {
-        current->next = block->next;
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == MM_TRACE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
     }
 
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    mm_trace_event_t *event = &ring->events[head % MM_TRACE];
+    event->time_ns = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+    event->size = size;
+    event->probes = (uint32_t)probes;
+    event->thread = ring->id;
+    event->op = (uint8_t)op;
+    event->size_class = (size > 0) ? (uint8_t)size_to_class(size) : 0;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
 }
 
 /**
- * @brief Inserts a free mini block at head of mini block free list (LIFO)
- * 
- * This function adds the specified mini block to the front of the
- * singly-linked mini block free list.
+ * @brief Moves events from every ring into a buffer
  *
- * @param[in] block Pointer to the free mini block to insert
- * @pre block must be free and mini (16 bytes)
+ * @param[out] events Receives the events
+ * @param[in] max Capacity of events
+ * @return Number of events stored, 0 if another thread is draining
  */
-static void add_to_mini_list(block_t *block){
-    dbg_requires(block != NULL);
-    dbg_requires(!get_alloc(block));
-    dbg_requires(get_mini(block));
+static size_t trace_drain(mm_trace_event_t *events, size_t max) {
+    if (atomic_flag_test_and_set(&trace_draining)) {
+        return 0;
+    }
+
+    size_t n = 0;
+    for (trace_ring_t *ring = atomic_load(&trace_rings); ring != NULL && n < max; ring = ring->next) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head && n < max; tail++) {
+            events[n++] = ring->events[tail % MM_TRACE];
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
 
-    block -> next = mini_block_head;
-    mini_block_head = block;
+    atomic_flag_clear(&trace_draining);
+    return n;
 }
 
 /**
- * @brief Merges a free block with adjacent free blocks to reduce fragmentation
+ * @brief Returns the number of events dropped by full rings so far
+ */
+static size_t trace_dropped(void) {
+    size_t n = 0;
+    for (trace_ring_t *ring = atomic_load(&trace_rings); ring != NULL; ring = ring->next) {
+        n += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+    return n;
+}
+
+/**
+ * @brief Sets which ops are recorded
  *
- * @param[in] block Pointer to the newly freed block
- * @return Pointer to the coalesced block
+ * @param[in] ops Bit op set for each mm_trace_op to record
+ * @return The previous set
  */
-static block_t *coalesce_block(block_t *block) {
+static unsigned trace_select(unsigned ops) {
+    return atomic_exchange(&trace_ops, ops);
+}
+
+#else
+
+static void trace_event(unsigned op, size_t size, size_t probes) {
+    (void)op;
+    (void)size;
+    (void)probes;
+}
+
+static size_t trace_drain(mm_trace_event_t *events, size_t max) {
+    (void)events;
+    (void)max;
+    return 0;
+}
+
+static size_t trace_dropped(void) {
+    return 0;
+}
+
+static unsigned trace_select(unsigned ops) {
+    (void)ops;
+    return 0;
+}
+
+#endif /* MM_TRACE > 0 */
+
+/*
+ * ---------------------------------------------------------------------------
+ *                          TREE OF LARGE FREE BLOCKS
+ * ---------------------------------------------------------------------------
+ *
+ * Free blocks of at least tree_min_size bytes are kept in one treap per
+ * arena instead of the size class lists. The treap is ordered by size and
+ * then by address, so the leftmost block of at least a given size is the
+ * exact best fit, with ties going to the lowest address. A node's priority
+ * is a hash of its address, so the left and right links reuse the list
+ * links and no extra word is needed. The expected depth is O(log n).
+ *
+ * Tree blocks also record whether they are known to read as zero, so
+ * calloc can skip clearing memory that is fresh from the OS or purged.
+ * The tag lives in the fourth payload word; add_to_free_list clears it
+ * and the few callers that know better set it afterwards.
+ */
+
+/** @brief Free blocks at least this large live in the tree (bytes) */
+static const size_t tree_min_size = (1 << 12);
+
+/**
+ * @brief Payload bytes of a known-zero block that may hold list metadata
+ *
+ * The links, the dirty stamp and the zero tag itself; together with the
+ * header and footer these are the only bytes of such a block that need
+ * not read as zero.
+ */
+static const size_t zero_skip = 4 * sizeof(word_t);
+
+/**
+ * @brief Returns the zero tag of a tree block
+ * @param[in] block A free block of at least tree_min_size bytes
+ */
+static word_t *zero_tag(block_t *block) {
+    return (word_t *)(block->payload + zero_skip) - 1;
+}
+
+/**
+ * @brief Returns whether a free block is known to read as zero
+ *
+ * Only tree blocks carry a tag; smaller blocks are never known zero.
+ *
+ * @param[in] block A free block
+ */
+static bool get_zeroed(block_t *block) {
+    return get_size(block) >= tree_min_size && *zero_tag(block) != 0;
+}
+
+/**
+ * @brief Records whether a free block reads as zero apart from its metadata
+ * @param[in] block A free block; ignored unless it is a tree block
+ * @param[in] zeroed The new state
+ */
+static void set_zeroed(block_t *block, bool zeroed) {
+    if (get_size(block) >= tree_min_size) {
+        *zero_tag(block) = zeroed;
+    }
+}
+
+/**
+ * @brief Returns whether block a orders before block b in the tree
+ */
+static bool tree_less(block_t *a, block_t *b) {
+    size_t a_size = get_size(a);
+    size_t b_size = get_size(b);
+    return a_size < b_size || (a_size == b_size && a < b);
+}
+
+/**
+ * @brief Returns the heap priority of a tree node, derived from its address
+ */
+static word_t tree_priority(block_t *block) {
+    return (word_t)(uintptr_t)block * 0x9E3779B97F4A7C15u;
+}
+
+/**
+ * @brief Splits a subtree into the nodes ordering before and after `key`
+ *
+ * @param[in] t Root of the subtree
+ * @param[in] key A block not in the subtree
+ * @param[out] lo Receives the nodes before `key`
+ * @param[out] hi Receives the nodes after `key`
+ */
+static void tree_split(block_t *t, block_t *key, block_t **lo, block_t **hi) {
+    if (t == NULL) {
+        *lo = *hi = NULL;
+    } else if (tree_less(t, key)) {
+        tree_split(t->right, key, &t->right, hi);
+        *lo = t;
+    } else {
+        tree_split(t->left, key, lo, &t->left);
+        *hi = t;
+    }
+}
+
+/**
+ * @brief Joins two subtrees, every node of `lo` ordering before `hi`
+ * @return Root of the joined subtree
+ */
+static block_t *tree_join(block_t *lo, block_t *hi) {
+    if (lo == NULL) return hi;
+    if (hi == NULL) return lo;
+    if (tree_priority(lo) > tree_priority(hi)) {
+        lo->right = tree_join(lo->right, hi);
+        return lo;
+    }
+    hi->left = tree_join(lo, hi->left);
+    return hi;
+}
+
+/**
+ * @brief Inserts a node into a subtree
+ * @return Root of the updated subtree
+ */
+static block_t *tree_insert(block_t *t, block_t *block) {
+    if (t == NULL || tree_priority(block) > tree_priority(t)) {
+        tree_split(t, block, &block->left, &block->right);
+        return block;
+    }
+    if (tree_less(block, t)) t->left = tree_insert(t->left, block);
+    else                     t->right = tree_insert(t->right, block);
+    return t;
+}
+
+/**
+ * @brief Removes a node from a subtree containing it
+ * @return Root of the updated subtree
+ */
+static block_t *tree_remove(block_t *t, block_t *block) {
+    if (t == block) {
+        return tree_join(block->left, block->right);
+    }
+    if (tree_less(block, t)) t->left = tree_remove(t->left, block);
+    else                     t->right = tree_remove(t->right, block);
+    return t;
+}
+
+/**
+ * @brief Returns the smallest (then lowest-addressed) block of at least `asize`
+ * @param[in] asize Required size (aligned)
+ * @return The best fit in the tree, or NULL if no block is large enough
+ */
+static block_t *tree_best_fit(size_t asize) {
+    block_t *best = NULL;
+    size_t probes = 0;
+    for (block_t *t = arena->tree; t != NULL; probes++) {
+        if (get_size(t) >= asize) {
+            best = t;
+            t = t->left;
+        } else {
+            t = t->right;
+        }
+    }
+    arena->stats.fit_probes += probes;
+    return best;
+}
+
+/**
+ * @brief Inserts a free block at head of its size class list (LIFO)
+ *
+ * Blocks of at least tree_min_size go into the tree instead.
+ *
+ * @param[in] block Pointer to the free block to insert
+ */
+static void add_to_free_list(block_t *block){
     dbg_requires(block != NULL);
     dbg_requires(!get_alloc(block));
 
-    block_t *next = find_next(block);
-    block_t *prev = NULL;
-    if(!get_prev_alloc(block)){
-        prev = find_prev(block);
+    arena->stats.free_bytes += get_size(block);
+    if (get_size(block) >= tree_min_size) {
+        arena->tree = tree_insert(arena->tree, block);
+        arena->stats.tree_blocks++;
+        mark_dirty(block);
+        set_zeroed(block, false);
+        return;
     }
 
-    bool prev_alloced = get_prev_alloc(block) || (prev == NULL);
-    bool next_alloced = (next == NULL) || get_alloc(next);
+    int class = size_to_class(get_size(block));
+    arena->stats.class_blocks[class]++;
 
-    bool free_free_free = !prev_alloced && !next_alloced;
-    bool free_free_alloced = !prev_alloced && next_alloced;
-    bool alloced_free_free = prev_alloced && !next_alloced;
-    bool alloced_free_alloced = prev_alloced && next_alloced;
+    block->next = arena->size_class[class];
+    block->prev = NULL;
 
-    size_t size = get_size(block);
+    if (arena->size_class[class] != NULL) {
+        arena->size_class[class]->prev = block;
+    }
+    
+    arena->size_class[class] = block;
+    arena->class_map |= (uint64_t)1 << class;
+    mark_dirty(block);
+}
 
-    if(free_free_free){
-        size += get_size(prev);
-        size += get_size(next);
+/**
+ * @brief Removes a free block from its size class list or the tree
+ *
+ * @param[in] block Pointer to the free block to remove
+ */
+static void rem_from_free_list(block_t *block){
+    dbg_requires(block != NULL);
+    dbg_requires(!get_alloc(block));
 
-        if(get_mini(prev)) rem_from_mini_list(prev);
-        else               rem_from_free_list(prev);
+    arena->stats.free_bytes -= get_size(block);
+    if (get_size(block) >= tree_min_size) {
+        arena->tree = tree_remove(arena->tree, block);
+        arena->stats.tree_blocks--;
+        return;
+    }
 
-        if(get_mini(next)) rem_from_mini_list(next);
-        else               rem_from_free_list(next);
+    block_t *old_prev = block -> prev;
+    block_t *old_next = block -> next;
 
-        write_block(prev, size, false, get_prev_alloc(prev), get_prev_mini(prev));
+    int class = size_to_class(get_size(block));    
+    arena->stats.class_blocks[class]--;
 
-        clear_prev_alloc(find_next(prev));
-        clear_prev_mini(find_next(prev));
+    if(old_prev == NULL && old_next == NULL){
+        // NULL <-> __block__ <-> NULL
+        arena->size_class[class] = NULL;
+        arena->class_map &= ~((uint64_t)1 << class);
+    } else if(old_prev != NULL && old_next != NULL){
+        // block <-> __block__ <-> block
+        old_prev -> next = old_next;
+        old_next -> prev = old_prev;
+    } else if(old_prev != NULL && old_next == NULL){
+        // block <-> __block__ <-> NULL
+        old_prev -> next = NULL;
+    } else if(old_prev == NULL && old_next != NULL){
+        // NULL <-> __block__ <-> block
+        old_next -> prev = NULL;
+        arena->size_class[class] = old_next;
+    }
+}
 
-        return prev;
-    } else if(free_free_alloced){
-        size += get_size(prev);
-        if(get_mini(prev)) rem_from_mini_list(prev);
-        else               rem_from_free_list(prev);
+/**
+ * @brief Returns the predecessor of a listed mini block
+ *
+ * @param[in] block A free mini block on the mini list
+ * @return The previous block on the mini list, or NULL at the head
+ */
+static block_t *get_mini_prev(block_t *block) {
+    dbg_requires(block->header & mini_link_mask);
+    word_t link = block->header & size_mask;
+    return (link == 0) ? NULL : payload_to_header((void *)link);
+}
 
-        write_block(prev, size, false, get_prev_alloc(prev), get_prev_mini(prev));
+/**
+ * @brief Stores the predecessor of a listed mini block in its header
+ *
+ * The alloc, prev_alloc and prev_mini bits are preserved.
+ *
+ * @param[in] block A free mini block on the mini list
+ * @param[in] prev The previous block on the mini list, or NULL
+ */
+static void set_mini_prev(block_t *block, block_t *prev) {
+    word_t link = (prev == NULL) ? 0 : (word_t)prev->payload;
+    block->header = link | mini_link_mask | (block->header & flag_mask);
+}
 
-        clear_prev_alloc(find_next(prev));
-        clear_prev_mini(find_next(prev));
+/**
+ * @brief Removes a free mini block from the mini block free list
+ * 
+ * The list is doubly linked, with `next` in the payload and the previous
+ * pointer in the header (see mini_link_mask), so this is O(1). The header
+ * is restored to an ordinary mini block header.
+ *
+ * @param[in] block Pointer to the mini block to remove
+ * @pre block must be free, mini, and in the mini block list
+ */
+static void rem_from_mini_list(block_t *block){
+    dbg_requires(block != NULL);
+    dbg_requires(arena->mini_block_head != NULL);
+    dbg_requires(!get_alloc(block));
+    dbg_requires(get_mini(block));
 
-        return prev;
-    } else if(alloced_free_free){
-        size += get_size(next);
-        if(get_mini(next)) rem_from_mini_list(next);
-        else               rem_from_free_list(next);
+    block_t *prev = get_mini_prev(block);
+    block_t *next = block->next;
 
-        write_block(block, size, false, get_prev_alloc(block), get_prev_mini(block));
+    if (prev == NULL) {
+        arena->mini_block_head = next;
+    } else {
+        prev->next = next;
+    }
+    if (next != NULL) {
+        set_mini_prev(next, prev);
+    }
 
-        clear_prev_alloc(find_next(block));
-        clear_prev_mini(find_next(block));
-        
-        return block;
-    } else if(alloced_free_alloced){
-        clear_prev_alloc(next);
-        if(get_mini(block)) set_prev_mini(next);
-        else                clear_prev_mini(next);
-        return block;
+    block->header = mb_block_size | (block->header & flag_mask);
+    arena->stats.mini_blocks--;
+    arena->stats.free_bytes -= mb_block_size;
+}
+
+/**
+ * @brief Inserts a free mini block at head of mini block free list (LIFO)
+ * 
+ * This function adds the specified mini block to the front of the
+ * doubly-linked mini block free list.
+ *
+ * @param[in] block Pointer to the free mini block to insert
+ * @pre block must be free and mini (16 bytes)
+ */
+static void add_to_mini_list(block_t *block){
+    dbg_requires(block != NULL);
+    dbg_requires(!get_alloc(block));
+    dbg_requires(get_mini(block));
+
+    set_mini_prev(block, NULL);
+    block -> next = arena->mini_block_head;
+    if (arena->mini_block_head != NULL) {
+        set_mini_prev(arena->mini_block_head, block);
+    }
+    arena->mini_block_head = block;
+    arena->stats.mini_blocks++;
+    arena->stats.free_bytes += mb_block_size;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *                        RETURNING MEMORY TO THE OS
+ * ---------------------------------------------------------------------------
+ *
+ * Free blocks of at least purge_min_size bytes carry a dirty stamp in the
+ * word after their list links: the number of the first purge pass to run
+ * after their oldest unpurged page was freed, or 0 if all their pages are
+ * clean (purged or never touched). A freed block is stamped with the
+ * current pass number, a split remainder keeps its parent's stamp and a
+ * coalesced block takes the oldest stamp of its parts, so pages that were
+ * merely carried along by a split or merge keep ageing.
+ *
+ * free() starts a purge pass when it leaves a large free block behind and
+ * MM_DECAY_MS have passed since the previous pass. A pass purges only
+ * blocks stamped before the previous pass, so their pages have been idle
+ * for at least one full interval: whole pages inside the block are
+ * released with madvise(MADV_DONTNEED) and read back as zeros, while the
+ * header, links, stamp and footer stay resident. Small partial pages at
+ * either end are cleared by hand, so a purged block is known zero. With
+ * several arenas the arena's break can also move back, so a stale block
+ * at the end of the heap is trimmed to chunksize bytes (rounded up to a
+ * page boundary) instead. Pages are heap_page_size bytes, so with huge
+ * pages only whole huge pages are ever released.
+ */
+
+#if MM_DECAY_MS > 0
+
+/** @brief Smallest free block whose pages are worth purging (bytes) */
+static const size_t purge_min_size = (1 << 16);
+
+/** @brief Most bytes on partial pages purge_range clears by hand */
+static const size_t purge_clear_max = (1 << 13);
+
+/**
+ * @brief Returns the dirty stamp of a large free block
+ * @param[in] block A free block of at least purge_min_size bytes
+ */
+static word_t *dirty_stamp(block_t *block) {
+    return (word_t *)(block->payload + dsize);
+}
+
+/**
+ * @brief Returns a free block's dirty stamp, or 0 if it is too small to have one
+ * @param[in] block A free block
+ */
+static word_t get_stamp(block_t *block) {
+    return get_size(block) >= purge_min_size ? *dirty_stamp(block) : 0;
+}
+
+/**
+ * @brief Sets the dirty stamp of a free block large enough to hold one
+ * @param[in] block A free block
+ * @param[in] stamp The new stamp
+ */
+static void set_stamp(block_t *block, word_t stamp) {
+    if (get_size(block) >= purge_min_size) {
+        *dirty_stamp(block) = stamp;
+    }
+}
+
+/**
+ * @brief Marks a newly listed free block as holding recently used pages
+ *
+ * Callers that know the block's history overwrite the stamp afterwards.
+ *
+ * @param[in] block A free block on a size class list
+ */
+static void mark_dirty(block_t *block) {
+    set_stamp(block, arena->purge_gen);
+}
+
+/**
+ * @brief Returns the older of two dirty stamps, ignoring clean ones
+ */
+static word_t older_stamp(word_t a, word_t b) {
+    if (a == 0) return b;
+    if (b == 0) return a;
+    return a < b ? a : b;
+}
+
+/**
+ * @brief Returns the stamp a free block should carry once coalesced
+ *
+ * @param[in] block A free block about to be coalesced
+ * @param[in] touched false if the block's pages are fresh from the OS
+ * @return The oldest stamp among the block and the neighbors it absorbs
+ */
+static word_t merged_stamp(block_t *block, bool touched) {
+    word_t stamp = touched ? arena->purge_gen : 0;
+    if (!get_prev_alloc(block)) {
+        stamp = older_stamp(stamp, get_stamp(find_prev(block)));
+    }
+    block_t *next = find_next(block);
+    if (!get_alloc(next)) {
+        stamp = older_stamp(stamp, get_stamp(next));
+    }
+    return stamp;
+}
+
+/**
+ * @brief Releases the whole pages of [lo, hi) back to the OS
+ *
+ * The bytes of the range on partial pages are cleared too if there are at
+ * most purge_clear_max of them, so the whole range then reads as zero.
+ *
+ * @param[in] lo First byte of the range
+ * @param[in] hi One past the last byte of the range
+ * @return true if all of [lo, hi) now reads as zero; the range is left
+ *         untouched if its pages could not be released
+ */
+static bool purge_range(char *lo, char *hi) {
+    char *first = (char *)round_up((uintptr_t)lo, heap_page_size);
+    char *last = (char *)((uintptr_t)hi & ~(uintptr_t)(heap_page_size - 1));
+    if (first >= last) {
+        first = last = hi;
+    } else if (!release_pages(first, (size_t)(last - first))) {
+        return false;
+    }
+
+    if ((size_t)(first - lo) + (size_t)(hi - last) > purge_clear_max) {
+        return false;
+    }
+    memset(lo, 0, (size_t)(first - lo));
+    memset(last, 0, (size_t)(hi - last));
+    return true;
+}
+
+/**
+ * @brief Shrinks the heap to end chunksize bytes into its last free block
+ *
+ * Only arenas with their own reserved slice can give back their break.
+ * The new break is rounded up to a page boundary; since extend_heap ends
+ * the heap on one too, every released page is whole and the slice above
+ * the break keeps reading as zero.
+ *
+ * @param[in] block The free block just before the epilogue
+ * @return true if the heap was trimmed
+ */
+static bool trim_heap(block_t *block) {
+#if MM_ARENAS > 1
+    char *old_brk = arena->brk;
+    char *brk = (char *)round_up((uintptr_t)block + chunksize + wsize, heap_page_size);
+    if (brk >= old_brk || !purge_range(brk, old_brk)) {
+        return false;
+    }
+
+    // The old footer and epilogue went with the purged pages
+    rem_from_free_list(block);
+    write_block(block, (size_t)(brk - wsize - (char *)block), false,
+                get_prev_alloc(block), get_prev_mini(block));
+    arena->brk = brk;
+    write_epilogue(find_next(block));
+    add_to_free_list(block);
+#if MM_HUGE_PAGES == 2
+    arena->committed = brk;
+#endif
+    return true;
+#else
+    (void)block;
+    return false;
+#endif
+}
+
+/**
+ * @brief Returns whether a free block's pages have been idle a full interval
+ * @param[in] block A free block
+ */
+static bool is_stale(block_t *block) {
+    word_t stamp = get_stamp(block);
+    return stamp != 0 && stamp < arena->purge_gen;
+}
+
+/**
+ * @brief Purges the stale blocks of a subtree of the large-block tree
+ * @param[in] t Root of the subtree
+ */
+static void purge_tree(block_t *t) {
+    if (t == NULL) {
+        return;
+    }
+    purge_tree(t->left);
+    if (is_stale(t)) {
+        bool zeroed = purge_range((char *)(zero_tag(t) + 1), (char *)header_to_footer(t));
+        *dirty_stamp(t) = 0;
+        set_zeroed(t, zeroed);
+    }
+    purge_tree(t->right);
+}
+
+/**
+ * @brief Purges or trims every large free block idle since the last pass
+ *
+ * Every block large enough to purge lives in the tree.
+ */
+static void purge_dirty(void) {
+    block_t *epilogue = (block_t *)((char *)arena_heap_hi(arena) - 7);
+    if (!get_prev_alloc(epilogue)) {
+        block_t *last = find_prev(epilogue);
+        if (is_stale(last)) {
+            trim_heap(last);
+        }
+    }
+
+    purge_tree(arena->tree);
+    arena->purge_gen++;
+}
+
+/**
+ * @brief Runs a purge pass if MM_DECAY_MS have passed since the last one
+ */
+static void purge_decayed(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+
+    if (now - arena->purge_last_ms >= MM_DECAY_MS) {
+        arena->purge_last_ms = now;
+        purge_dirty();
+    }
+}
+
+#else
+
+static const size_t purge_min_size = SIZE_MAX;
+
+static word_t get_stamp(block_t *block) {
+    (void)block;
+    return 0;
+}
+
+static void set_stamp(block_t *block, word_t stamp) {
+    (void)block;
+    (void)stamp;
+}
+
+static void mark_dirty(block_t *block) {
+    (void)block;
+}
+
+static word_t merged_stamp(block_t *block, bool touched) {
+    (void)block;
+    (void)touched;
+    return 0;
+}
+
+static void purge_decayed(void) {
+}
+
+#endif /* MM_DECAY_MS > 0 */
+
+/**
+ * @brief Merges a free block with adjacent free blocks to reduce fragmentation
+ *
+ * @param[in] block Pointer to the newly freed block
+ * @return Pointer to the coalesced block
+ */
+static block_t *coalesce_block(block_t *block) {
+    dbg_requires(block != NULL);
+    dbg_requires(!get_alloc(block));
+
+    block_t *next = find_next(block);
+    block_t *prev = NULL;
+    if(!get_prev_alloc(block)){
+        prev = find_prev(block);
+    }
+
+    bool prev_alloced = get_prev_alloc(block) || (prev == NULL);
+    bool next_alloced = (next == NULL) || get_alloc(next);
+
+    bool free_free_free = !prev_alloced && !next_alloced;
+    bool free_free_alloced = !prev_alloced && next_alloced;
+    bool alloced_free_free = prev_alloced && !next_alloced;
+    bool alloced_free_alloced = prev_alloced && next_alloced;
+
+    size_t size = get_size(block);
+
+    if(free_free_free){
+        size += get_size(prev);
+        size += get_size(next);
+        arena->stats.coalesces += 2;
+
+        if(get_mini(prev)) rem_from_mini_list(prev);
+        else               rem_from_free_list(prev);
+
+        if(get_mini(next)) rem_from_mini_list(next);
+        else               rem_from_free_list(next);
+
+        write_block(prev, size, false, get_prev_alloc(prev), get_prev_mini(prev));
+
+        clear_prev_alloc(find_next(prev));
+        clear_prev_mini(find_next(prev));
+
+        trace_event(MM_TRACE_COALESCE, size, 2);
+        return prev;
+    } else if(free_free_alloced){
+        size += get_size(prev);
+        arena->stats.coalesces++;
+        if(get_mini(prev)) rem_from_mini_list(prev);
+        else               rem_from_free_list(prev);
+
+        write_block(prev, size, false, get_prev_alloc(prev), get_prev_mini(prev));
+
+        clear_prev_alloc(find_next(prev));
+        clear_prev_mini(find_next(prev));
+
+        trace_event(MM_TRACE_COALESCE, size, 1);
+        return prev;
+    } else if(alloced_free_free){
+        size += get_size(next);
+        arena->stats.coalesces++;
+        if(get_mini(next)) rem_from_mini_list(next);
+        else               rem_from_free_list(next);
+
+        write_block(block, size, false, get_prev_alloc(block), get_prev_mini(block));
+
+        clear_prev_alloc(find_next(block));
+        clear_prev_mini(find_next(block));
+        
+        trace_event(MM_TRACE_COALESCE, size, 1);
+        return block;
+    } else if(alloced_free_alloced){
+        clear_prev_alloc(next);
+        if(get_mini(block)) set_prev_mini(next);
+        else                clear_prev_mini(next);
+        return block;
+    }
+    return block;
+}
+
+/**
+ * @brief Extends heap when no suitable free block exists
+ *
+ * @param[in] size Number of bytes to request (rounded to alignment)
+ * @return Pointer to the new free block, or NULL on failure
+ */
+static block_t *extend_heap(size_t size) {
+    void *bp;
+
+    // Allocate an even number of words to maintain alignment
+    size = round_up(size, dsize);
+    // An arena's heap is created when it first grows
+    if (arena->heap_start == NULL && !create_heap()) {
+        return NULL;
+    }
+#if MM_HUGE_PAGES
+    // End the heap on a huge page boundary
+    char *brk = (char *)arena_heap_hi(arena) + 1;
+    size = (size_t)((char *)round_up((uintptr_t)brk + size, heap_page_size) - brk);
+#endif
+    if ((bp = arena_sbrk(size)) == (void *)-1) {
+        return NULL;
+    }
+    arena->stats.extends++;
+    trace_event(MM_TRACE_EXTEND, size, 0);
+
+    // Initialize free block header/footer
+    block_t *block = payload_to_header(bp);
+    write_block(block, size, false, get_prev_alloc(block), get_prev_mini(block));
+
+    // Create new epilogue header
+    block_t *block_next = find_next(block);
+    write_epilogue(block_next);
+
+    // Fresh pages stay known zero if any free block they join was too
+    bool zeroed = sbrk_zeroed && (get_prev_alloc(block) || get_zeroed(find_prev(block)));
+
+    // Coalesce in case the previous block was free
+    word_t stamp = merged_stamp(block, false);
+    block_t *chunk = block;
+    block = coalesce_block(block);
+    add_to_free_list(block);
+    set_stamp(block, stamp);
+
+    if (zeroed) {
+        // The old footer and epilogue are now inside the merged block
+        if (block != chunk) {
+            ((word_t *)chunk)[-1] = 0;
+            chunk->header = 0;
+        }
+        set_zeroed(block, true);
+    }
+
+    return block;
+}
+
+/**
+ * @brief Extends the heap by at least `need` bytes, growing geometrically
+ *
+ * The extension is rounded up to 1/2^MM_GROW_SHIFT of the current heap,
+ * capped at MM_GROW_MAX, so warming up a large heap takes few sbrk calls
+ * and few coalesce-and-insert rounds. If the heap cannot grow that far, it
+ * grows by just `need` (at least chunksize).
+ *
+ * @param[in] need Number of bytes the caller requires
+ * @return Pointer to the new free block, or NULL on failure
+ */
+static block_t *grow_heap(size_t need) {
+    size_t size = max(need, chunksize);
+
+#if MM_GROW_SHIFT > 0
+    size_t heap = (size_t)((char *)arena_heap_hi(arena) + 1 - (char *)arena_heap_lo(arena));
+    size_t step = heap >> MM_GROW_SHIFT;
+    if (step > MM_GROW_MAX) {
+        step = MM_GROW_MAX;
+    }
+    if (step > size) {
+        block_t *block = extend_heap(round_up(step, chunksize));
+        if (block != NULL) {
+            return block;
+        }
+    }
+#endif
+
+    return extend_heap(size);
+}
+
+// done
+/**
+ * @brief Splits a block if remainder is large enough to be useful
+ *
+ * @param[in] block Pointer to block to split
+ * @param[in] asize Desired allocated size (aligned)
+ */
+static void split_block(block_t *block, size_t asize) {
+    dbg_requires(!get_alloc(block));
+    dbg_requires(!get_mini(block));
+    dbg_requires(asize >= mb_block_size);
+    dbg_requires(asize % dsize == 0);
+
+    size_t block_size = get_size(block);
+    size_t remainder = block_size - asize;
+
+    if (remainder < split_min_size) {
+        // Too little is left over to be worth a free block
+        write_block(block, block_size, true, get_prev_alloc(block), get_prev_mini(block));
+        set_prev_alloc(find_next(block));
+        if (block_size == mb_block_size) set_prev_mini(find_next(block));
+        else                             clear_prev_mini(find_next(block));
+        return;
+    }
+
+    // block_t *block, size_t size, bool alloc, bool prev_alloc, bool prev_mini
+    if (asize == mb_block_size) {
+        // ALLOCATING first part as MINI
+        if (remainder >= min_block_size) {
+            // CASE: alloc mini | free regular
+            write_block(block, mb_block_size, true, get_prev_alloc(block), get_prev_mini(block));
+
+            block_t *block_next = find_next(block);
+            write_block(block_next, remainder, false, true, true);
+            add_to_free_list(block_next);
+
+            clear_prev_alloc(find_next(block_next));
+            clear_prev_mini(find_next(block_next));
+        } 
+        else if (remainder == mb_block_size) {
+            // CASE: alloc mini | free mini
+            write_block(block, mb_block_size, true, get_prev_alloc(block), get_prev_mini(block));
+
+            block_t *block_next = find_next(block);
+            write_block(block_next, mb_block_size, false, true, true);
+            add_to_mini_list(block_next);
+            
+            clear_prev_alloc(find_next(block_next));
+            set_prev_mini(find_next(block_next));
+        } 
+        
+    } else {
+        // ALLOCATING first part as REGULAR
+        if (remainder >= min_block_size) {
+            // CASE: alloc regular | free reg
+            write_block(block, asize, true, get_prev_alloc(block), get_prev_mini(block));
+
+            block_t *block_next = find_next(block);
+            write_block(block_next, remainder, false, true, false);
+            add_to_free_list(block_next);
+
+            clear_prev_alloc(find_next(block_next));
+            clear_prev_mini(find_next(block_next));
+        } 
+        else if (remainder == mb_block_size) {
+            // CASE: alloc regular | Create 16 mini free
+            write_block(block, asize, true, get_prev_alloc(block), get_prev_mini(block));
+
+            block_t *block_next = find_next(block);
+            write_block(block_next, mb_block_size, false, true, false);
+            add_to_mini_list(block_next);
+            
+            clear_prev_alloc(find_next(block_next));
+            set_prev_mini(find_next(block_next));
+        } 
+    }
+    arena->stats.splits++;
+    trace_event(MM_TRACE_SPLIT, remainder, 0);
+    dbg_ensures(get_alloc(block));
+}
+
+/**
+ * @brief Bounded best-fit search of one size class
+ *
+ * Examines at most max_search blocks of the class and returns the smallest
+ * that fits, stopping early on an exact fit.
+ *
+ * @param[in] class The size class to search
+ * @param[in] asize Required size (aligned)
+ * @return The best block seen, or NULL if none of them fit
+ */
+static block_t *best_fit_in_class(int class, size_t asize) {
+    block_t *block;
+    block_t *best = NULL;
+    size_t best_size = SIZE_MAX;
+    int search_count = 0;
+
+    for(block = arena->size_class[class]; block != NULL && search_count < max_search; block = block->next){
+        size_t size = get_size(block);
+        if(asize <= size && size < best_size){
+            best = block;
+            best_size = size;
+            if(size == asize) break;
+        }
+        search_count++;
+    }
+
+    arena->stats.fit_probes += (size_t)search_count;
+    return best;
+}
+
+// done
+/**
+ * @brief Searches size classes for a block large enough for request
+ *
+ * Within the request's own class every block is at most 25% larger than
+ * the request (with the default MM_CLASS_BITS), so the first fit is taken
+ * unless MM_FIT_SEARCH asks for an exact best fit. Larger classes use a
+ * best fit bounded by max_search, and blocks of at least tree_min_size
+ * come from the tree's exact best fit.
+ *
+ * Every probe reads a free block's header, which in a large heap is
+ * almost always a cache miss, and a request near the top of its class may
+ * find most of the class too small. So the first fit gives up after
+ * max_search blocks and the larger classes, any of whose blocks fits, are
+ * tried first. The rest of the own class is searched only if they are all
+ * empty, ahead of the tree and of extending the heap.
+ *
+ * @param[in] asize Required size (aligned)
+ * @return Pointer to suitable free block, or NULL if none found
+ */
+static block_t *search_fit(size_t asize) {
+    block_t *block;
+    
+    if(asize <= mb_block_size){
+        if(arena->mini_block_head != NULL){
+            arena->stats.fit_probes++;
+            return arena->mini_block_head;
+        }
+    }
+
+    if (asize >= tree_min_size) {
+        return tree_best_fit(asize);
+    }
+
+    int class = size_to_class(asize);
+    
+    // Probes past max_search in the own class wait for the larger classes
+    block_t *rest = NULL;
+    if (exact_fit) {
+        if (arena->size_class[class] != NULL) {
+            block = best_fit_in_class(class, asize);
+            if(block != NULL) return block;
+        }
+    } else {
+        int search_count = 0;
+        for(block = arena->size_class[class]; block != NULL; block = block->next){
+            if(search_count++ == max_search){
+                rest = block;
+                break;
+            }
+            arena->stats.fit_probes++;
+            if(asize <= get_size(block)){
+                return block;
+            }
+        }
+    }
+
+    // Visit only non-empty larger classes, lowest first
+    uint64_t larger = arena->class_map & ~(((uint64_t)2 << class) - 1);
+    for(; larger != 0; larger &= larger - 1){
+        block = best_fit_in_class(__builtin_ctzll(larger), asize);
+        if(block != NULL) return block;
+    }
+
+    // Finish the own class before taking a large block
+    for(block = rest; block != NULL; block = block->next){
+        arena->stats.fit_probes++;
+        if(asize <= get_size(block)){
+            return block;
+        }
+    }
+    
+    return tree_best_fit(asize);
+}
+
+/**
+ * @brief Finds a free block for a request, tracing the probes it took
+ *
+ * @param[in] asize Required size (aligned)
+ * @return Pointer to suitable free block, or NULL if none found
+ */
+static block_t *find_fit(size_t asize) {
+    size_t probes = arena->stats.fit_probes;
+    block_t *block = search_fit(asize);
+    trace_event(MM_TRACE_FIND_FIT, asize, arena->stats.fit_probes - probes);
+    return block;
+}
+
+/**
+ * @brief Rounds a request up to the block size that will satisfy it
+ *
+ * Requests of at most 8 bytes fit in a mini block; everything else needs a
+ * header plus a 16-byte aligned payload of at least min_block_size.
+ *
+ * @param[in] size Number of bytes requested (nonzero, at most SIZE_MAX / 2)
+ * @return The adjusted block size
+ */
+static size_t adjust_size(size_t size) {
+    if (size <= mb_dsize) {
+        return mb_block_size;
+    }
+    return max(round_up(size + wsize, dsize), min_block_size);
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *                           DEFERRED COALESCING
+ * ---------------------------------------------------------------------------
+ *
+ * With MM_QUICK_MAX > 0, free_payload parks blocks of up to MM_QUICK_MAX
+ * bytes on an exact-size quick list instead of coalescing them, and
+ * malloc_block hands them straight back to requests of the same adjusted
+ * size. Parked blocks keep their allocated headers, so neighbors never
+ * merge with them and the heap checker sees them as allocated. All quick
+ * lists are coalesced in one batch when they hold more than quick_limit
+ * blocks, or when a request finds no fit, which bounds the fragmentation
+ * they can cause.
+ */
+
+#if MM_QUICK_MAX > 0
+
+/** @brief Most blocks all quick lists may hold before a batch coalesce */
+static const unsigned quick_limit = 256;
+
+/**
+ * @brief Coalesces every block on the quick lists
+ * @return true if any block was released
+ */
+static bool quick_flush(void) {
+    if (arena->quick_count == 0) {
+        return false;
+    }
+    for (int i = 0; i < QUICK_BINS; i++) {
+        block_t *block;
+        while ((block = arena->quick[i]) != NULL) {
+            arena->quick[i] = block->next;
+            arena->quick_count--;
+            free_block(block);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Takes a parked block of exactly `asize` bytes
+ * @param[in] asize Adjusted block size
+ * @return The block, still marked allocated, or NULL if none is parked
+ */
+static block_t *quick_take(size_t asize) {
+    if (asize > MM_QUICK_MAX) {
+        return NULL;
+    }
+    unsigned bin = (unsigned)(asize / dsize) - 1;
+    block_t *block = arena->quick[bin];
+    if (block != NULL) {
+        arena->quick[bin] = block->next;
+        arena->quick_count--;
+    }
+    return block;
+}
+
+/**
+ * @brief Parks a freed block on its quick list
+ *
+ * @param[in] block An allocated block
+ * @return true if the block was parked, false if it must be freed
+ */
+static bool quick_put(block_t *block) {
+    size_t size = get_size(block);
+    if (size > MM_QUICK_MAX) {
+        return false;
+    }
+    if (arena->quick_count >= quick_limit) {
+        quick_flush();
+    }
+    unsigned bin = (unsigned)(size / dsize) - 1;
+    block->next = arena->quick[bin];
+    arena->quick[bin] = block;
+    arena->quick_count++;
+    return true;
+}
+
+/**
+ * @brief Forgets the quick lists of a freshly created heap
+ */
+static void quick_reset(void) {
+    for (int i = 0; i < QUICK_BINS; i++) {
+        arena->quick[i] = NULL;
+    }
+    arena->quick_count = 0;
+}
+
+#else
+
+static bool quick_flush(void) {
+    return false;
+}
+
+static block_t *quick_take(size_t asize) {
+    (void)asize;
+    return NULL;
+}
+
+static bool quick_put(block_t *block) {
+    (void)block;
+    return false;
+}
+
+static void quick_reset(void) {
+}
+
+#endif /* MM_QUICK_MAX > 0 */
+
+/**
+ * @brief Allocates a block of exactly-adjusted size from the segregated heap
+ *
+ * Checks the quick lists, the mini list, then the size classes, extending
+ * the heap if no fit exists, and splits the chosen block. The caller must hold the arena lock.
+ *
+ * @param[in] asize Adjusted block size (see adjust_size)
+ * @param[out] zeroed If not NULL, set to whether the block was carved from
+ *                    a known-zero block (see get_zeroed)
+ * @return The allocated block, or NULL if the heap cannot be extended
+ */
+static block_t *malloc_block(size_t asize, bool *zeroed) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+    if (zeroed != NULL) {
+        *zeroed = false;
+    }
+
+    block_t *block = quick_take(asize);
+    if (block != NULL) {
+        return block;
+    }
+
+    block = find_fit(asize);
+    // Parked blocks may coalesce into a fit
+    if (block == NULL && quick_flush()) {
+        block = find_fit(asize);
+    }
+
+    // CASE: allocate a mini-block and there is space in the mini-list
+    if (asize == mb_block_size && block != NULL && get_mini(block)) {
+        rem_from_mini_list(block);
+
+        write_block(block, mb_block_size, true, get_prev_alloc(block), get_prev_mini(block));
+
+        set_prev_alloc(find_next(block));
+        set_prev_mini(find_next(block));
+
+        dbg_ensures(mm_checkheap(__LINE__));
+        return block;
+    }
+
+    // If no fit is found, request more memory, and then and place the block
+    if (block == NULL) {
+        block = grow_heap(asize);
+        // extend_heap returns an error
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+
+    // The block should be marked as free
+    dbg_assert(!get_alloc(block));
+
+    // Try to split the block if too large; the remainder's pages keep ageing
+    word_t stamp = get_stamp(block);
+    bool zero = get_zeroed(block);
+    rem_from_free_list(block);
+    split_block(block, asize);
+    block_t *rest = find_next(block);
+    if (!get_alloc(rest)) {
+        set_stamp(rest, stamp);
+        set_zeroed(rest, zero);
+    }
+    if (zeroed != NULL) {
+        *zeroed = zero;
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return block;
+}
+
+/**
+ * @brief Carves up to `n` allocated blocks of `asize` bytes from a free block
+ *
+ * The blocks are laid out back to back from the start of `block`; what is
+ * left over is split off and listed once.
+ *
+ * @param[in] block A free regular block of at least asize bytes, already
+ *                  removed from its list
+ * @param[in] asize Adjusted block size
+ * @param[in] n Most blocks wanted
+ * @param[out] bps Receives the payloads
+ * @return Number of blocks carved (at least 1)
+ */
+static size_t carve_blocks(block_t *block, size_t asize, size_t n, void **bps) {
+    size_t size = get_size(block);
+    size_t count = size / asize < n ? size / asize : n;
+    bool mini = asize == mb_block_size;
+    word_t stamp = get_stamp(block);
+    bool zeroed = get_zeroed(block);
+
+    for (size_t i = 0; i + 1 < count; i++) {
+        write_block(block, asize, true, get_prev_alloc(block), get_prev_mini(block));
+        bps[i] = header_to_payload(block);
+        size -= asize;
+
+        block_t *rest = find_next(block);
+        rest->header = pack(size, false, true, mini);
+        block = rest;
+    }
+
+    // The last block takes care of the remainder and its successor's flags
+    if (size == mb_block_size) {
+        write_block(block, size, true, get_prev_alloc(block), get_prev_mini(block));
+        set_prev_alloc(find_next(block));
+        set_prev_mini(find_next(block));
+    } else {
+        write_block(block, size, false, get_prev_alloc(block), get_prev_mini(block));
+        split_block(block, asize);
+        block_t *rest = find_next(block);
+        if (!get_alloc(rest)) {
+            set_stamp(rest, stamp);
+            set_zeroed(rest, zeroed);
+        }
+    }
+    bps[count - 1] = header_to_payload(block);
+    arena->stats.mallocs[size_to_class(asize)] += count - 1;
+    count_malloc(get_size(block));
+    return count;
+}
+
+/**
+ * @brief Allocates up to `n` blocks of exactly-adjusted size
+ *
+ * Parked blocks are reused first. After that each free region found (or
+ * obtained by extending the heap) is carved into as many blocks as it
+ * holds. The caller must hold the arena lock.
+ *
+ * @param[in] asize Adjusted block size (see adjust_size)
+ * @param[in] n Number of blocks wanted
+ * @param[out] bps Receives the payloads
+ * @return Number of payloads stored; less than `n` only if the heap cannot
+ *         be extended
+ */
+static size_t malloc_blocks(size_t asize, size_t n, void **bps) {
+    size_t count = 0;
+    block_t *block;
+
+    while (count < n && (block = quick_take(asize)) != NULL) {
+        count_malloc(asize);
+        bps[count++] = header_to_payload(block);
+    }
+
+    // Regions are sought at most MM_GROW_MAX bytes at a time
+    size_t per_region = max(MM_GROW_MAX / asize, 1);
+
+    while (count < n) {
+        size_t want = (n - count < per_region ? n - count : per_region) * asize;
+
+        block = find_fit(want);
+        if (block == NULL) block = find_fit(asize);
+        if (block == NULL) block = grow_heap(want);
+
+        if (block == NULL || get_mini(block)) {
+            // Mini list entries (and the last resort) go one at a time
+            block = malloc_block(asize, NULL);
+            if (block == NULL) {
+                break;
+            }
+            count_malloc(get_size(block));
+            bps[count++] = header_to_payload(block);
+            continue;
+        }
+
+        rem_from_free_list(block);
+        count += carve_blocks(block, asize, n - count, bps + count);
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    return count;
+}
+
+/**
+ * @brief Returns an allocated block to the segregated heap
+ *
+ * Marks the block free, coalesces it with its neighbors and inserts the
+ * result into the mini list or its size class. The caller must hold the
+ * arena lock.
+ *
+ * @param[in] block An allocated block
+ */
+static void free_block(block_t *block) {
+    dbg_requires(mm_checkheap(__LINE__));
+
+    size_t size = get_size(block);
+
+    // The block should be marked as allocated
+    dbg_assert(get_alloc(block));
+
+    // Mark the block as free
+    write_block(block, size, false, get_prev_alloc(block), get_prev_mini(block));
+
+    // Try to coalesce the block with its neighbors
+    word_t stamp = merged_stamp(block, true);
+    block = coalesce_block(block);
+    if(get_mini(block)) add_to_mini_list(block);
+    else                add_to_free_list(block);
+    set_stamp(block, stamp);
+
+    // A large free block may mean others have been idle long enough
+    if (get_size(block) >= purge_min_size) {
+        purge_decayed();
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+}
+
+/**
+ * @brief Trims an allocated block to `asize`, freeing the tail
+ *
+ * The tail goes back to the heap through free_block, so it coalesces with
+ * a free successor. Nothing happens if the tail would be smaller than
+ * split_min_size. The caller must hold the arena lock.
+ *
+ * @param[in] block An allocated block
+ * @param[in] asize Adjusted size, at most the block's size
+ */
+static void shrink_block(block_t *block, size_t asize) {
+    size_t size = get_size(block);
+    dbg_requires(get_alloc(block));
+    dbg_requires(asize <= size);
+
+    if (size - asize < split_min_size) {
+        return;
+    }
+
+    write_block(block, asize, true, get_prev_alloc(block), get_prev_mini(block));
+    arena->stats.splits++;
+
+    // Hand the tail to free_block as an allocated block of its own
+    block_t *tail = find_next(block);
+    write_block(tail, size - asize, true, true, asize == mb_block_size);
+    free_block(tail);
+}
+
+/**
+ * @brief Resizes an allocated block without moving its payload
+ *
+ * Shrinking splits off the tail. Growing absorbs a free successor, first
+ * extending the heap if the block (or its free successor) is the last one
+ * before the epilogue. The caller must hold the arena lock.
+ *
+ * @param[in] block An allocated regular or mini block
+ * @param[in] asize Adjusted size wanted
+ * @return true if the block now has size `asize`, false if it cannot grow
+ *         in place
+ */
+static bool resize_block(block_t *block, size_t asize) {
+    size_t size = get_size(block);
+
+    if (asize <= size) {
+        shrink_block(block, asize);
+        return true;
+    }
+
+    block_t *next = find_next(block);
+    size_t avail = size;
+    if (!get_alloc(next)) {
+        avail += get_size(next);
+    }
+
+    if (avail < asize) {
+        // Only the last block before the epilogue can grow into new memory
+        block_t *last = get_alloc(next) ? next : find_next(next);
+        if (get_size(last) != 0) {
+            return false;
+        }
+        if (grow_heap(asize - avail) == NULL) {
+            return false;
+        }
+        next = find_next(block);
+    }
+
+    // Absorb the free successor, then give back what is not needed
+    if(get_mini(next)) rem_from_mini_list(next);
+    else               rem_from_free_list(next);
+
+    write_block(block, size + get_size(next), true, get_prev_alloc(block), get_prev_mini(block));
+    set_prev_alloc(find_next(block));
+    clear_prev_mini(find_next(block));
+
+    shrink_block(block, asize);
+    dbg_ensures(mm_checkheap(__LINE__));
+    return true;
+}
+
+/**
+ * @brief Returns the leading slack needed to align a block's payload
+ *
+ * The slack is 0 or at least mb_block_size, so it can always become a free
+ * block of its own.
+ *
+ * @param[in] block A block in the current arena
+ * @param[in] align Required payload alignment, a power of two of at
+ *                  least dsize
+ * @return Bytes to skip so that the payload becomes aligned
+ */
+static size_t align_slack(block_t *block, size_t align) {
+    size_t offset = (uintptr_t)header_to_payload(block) & (align - 1);
+    return (offset == 0) ? 0 : align - offset;
+}
+
+/**
+ * @brief Finds a free block with room for an aligned block of `asize`
+ *
+ * Like find_fit, but a candidate must also hold the leading slack
+ * align_slack reports for it. Searches at most max_search blocks per class,
+ * then the tree.
+ *
+ * @param[in] asize Adjusted block size
+ * @param[in] align Required payload alignment, a power of two of at
+ *                  least dsize
+ * @return A suitable free block, or NULL if none was found
+ */
+static block_t *find_aligned_fit(size_t asize, size_t align) {
+    uint64_t classes = arena->class_map & ~(((uint64_t)1 << size_to_class(asize)) - 1);
+
+    for(; classes != 0; classes &= classes - 1){
+        int search_count = 0;
+        block_t *block = arena->size_class[__builtin_ctzll(classes)];
+        for(; block != NULL && search_count < max_search; block = block->next){
+            arena->stats.fit_probes++;
+            if(align_slack(block, align) + asize <= get_size(block)){
+                return block;
+            }
+            search_count++;
+        }
+    }
+
+    // Failing the best fit, any block align bytes larger has room
+    block_t *block = tree_best_fit(asize);
+    if (block != NULL && align_slack(block, align) + asize <= get_size(block)) {
+        return block;
+    }
+    return tree_best_fit(asize + align);
+}
+
+/**
+ * @brief Allocates a block whose payload address is a multiple of `align`
+ *
+ * The leading slack of the chosen free block is split off in front as a
+ * free block of its own, and the tail is split as usual. The caller must
+ * hold the arena lock.
+ *
+ * @param[in] asize Adjusted block size
+ * @param[in] align Required payload alignment, a power of two of at
+ *                  least dsize
+ * @return The allocated block, or NULL if the heap cannot be extended
+ */
+static block_t *malloc_aligned_block(size_t asize, size_t align) {
+    block_t *block = find_aligned_fit(asize, align);
+    if (block == NULL && quick_flush()) {
+        block = find_aligned_fit(asize, align);
+    }
+    if (block == NULL) {
+        // Enough for the worst-case slack wherever the new space lands
+        block = grow_heap(asize + align);
+        if (block == NULL) {
+            return NULL;
+        }
+    }
+    rem_from_free_list(block);
+
+    size_t lead = align_slack(block, align);
+    if (lead != 0) {
+        // Leave the slack in front as a free block
+        size_t size = get_size(block);
+
+        write_block(block, lead, false, get_prev_alloc(block), get_prev_mini(block));
+        if (lead == mb_block_size) add_to_mini_list(block);
+        else                       add_to_free_list(block);
+
+        block_t *rest = find_next(block);
+        write_block(rest, size - lead, false, false, lead == mb_block_size);
+        block = rest;
+        arena->stats.splits++;
+    }
+
+    if (get_mini(block)) {
+        // Only a mini request can be left with exactly a mini block
+        write_block(block, mb_block_size, true, get_prev_alloc(block), get_prev_mini(block));
+        set_prev_alloc(find_next(block));
+        set_prev_mini(find_next(block));
+        return block;
+    }
+
+    split_block(block, asize);
+    return block;
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *                   SLAB RUNS FOR SMALL AND MEDIUM OBJECTS
+ * ---------------------------------------------------------------------------
+ *
+ * Requests of up to MM_SLAB_MAX bytes are served from runs: page-aligned
+ * regions of one or more slab_page_size pages holding objects of one size
+ * with no per-object header. A run is an ordinary allocated block of
+ * exactly its page count times slab_page_size bytes whose payload starts on
+ * a page boundary, so runs pack back to back and the only word of a run
+ * not owned by it is the next block's header in its last 8 bytes. The
+ * first slab_header_size bytes hold the object size and a bitmap of free
+ * objects; the objects follow. Objects of up to 256 bytes use single-page
+ * runs; larger ones use the shortest run that wastes little past its last
+ * object (see slab_run_pages).
+ *
+ * free() has no header to inspect, so each arena keeps a two-level page
+ * map (slab_map) with two bits per page of its heap: slab_map_start for
+ * the first page of a run, slab_map_body for its other pages, and 0 for
+ * pages outside runs. Leaves are allocated from the heap on demand. Map
+ * words are read without the arena lock by threads freeing into the arena,
+ * so they are accessed atomically.
+ */
+
+#if MM_SLAB_MAX > 0
+
+/** @brief Size and alignment of a slab map page (bytes) */
+static const size_t slab_page_size = (1 << 12);
+
+/** @brief Longest slab run (pages) */
+static const size_t slab_max_pages = 8;
+
+/** @brief Pages covered by one slab_map leaf */
+static const size_t slab_leaf_pages = 4096;
+
+/** @brief Map entries of the first and the following pages of a run */
+static const unsigned slab_map_start = 1;
+static const unsigned slab_map_body = 2;
+
+/** @brief Header of a run; objects start slab_header_size bytes in */
+typedef struct slab_run {
+    /** @brief Neighbors on the arena's partial list for this size */
+    struct slab_run *next;
+    struct slab_run *prev;
+    uint32_t obj_size;
+    uint16_t nobjs;
+    uint16_t nfree;
+    /** @brief Bit i is set while object i is free */
+    uint64_t free_map[4];
+    /** @brief Length of the run (pages) */
+    uint16_t pages;
+} slab_run_t;
+
+/** @brief Offset of the first object in a run (bytes) */
+static const size_t slab_header_size = 64;
+
+/**
+ * @brief Returns the index in an arena's slab map of the page holding p
+ *
+ * Pages are slab_page_size-aligned in the address space; page 0 holds the
+ * arena's first heap byte.
+ *
+ * @param[in] a The arena whose heap contains p
+ * @param[in] p An address in the heap
+ */
+static size_t slab_page(arena_t *a, void *p) {
+    return (uintptr_t)p / slab_page_size - (uintptr_t)arena_heap_lo(a) / slab_page_size;
+}
+
+/**
+ * @brief Returns an arena's slab map entry for a page
+ *
+ * @param[in] a The arena
+ * @param[in] page Index of the page in a's slab map
+ * @return slab_map_start, slab_map_body or 0
+ */
+static unsigned slab_map_get(arena_t *a, size_t page) {
+    size_t dir = page / slab_leaf_pages;
+    if (dir >= SLAB_MAP_DIRS) {
+        return 0;
+    }
+
+    uint64_t *leaf = __atomic_load_n(&a->slab_map[dir], __ATOMIC_ACQUIRE);
+    if (leaf == NULL) {
+        return 0;
+    }
+
+    size_t entry = page % slab_leaf_pages;
+    uint64_t word = __atomic_load_n(&leaf[entry / 32], __ATOMIC_RELAXED);
+    return (unsigned)(word >> (2 * (entry % 32))) & 3;
+}
+
+/**
+ * @brief Returns the run containing a payload, or NULL for regular blocks
+ *
+ * @param[in] a The arena whose heap contains bp
+ * @param[in] bp A payload returned by this allocator
+ */
+static slab_run_t *slab_run_of(arena_t *a, void *bp) {
+    size_t page = slab_page(a, bp);
+    unsigned entry = slab_map_get(a, page);
+    if (entry == 0) {
+        return NULL;
+    }
+
+    uintptr_t run = (uintptr_t)bp & ~(uintptr_t)(slab_page_size - 1);
+    while (entry == slab_map_body) {
+        run -= slab_page_size;
+        entry = slab_map_get(a, --page);
+    }
+    return (slab_run_t *)run;
+}
+
+/**
+ * @brief Returns the current arena's slab map leaf for a page
+ *
+ * @param[in] page Index of the page in the slab map
+ * @return The leaf, allocated if need be, or NULL if the page lies outside
+ *         the map or its leaf cannot be allocated
+ */
+static uint64_t *slab_map_leaf(size_t page) {
+    size_t dir = page / slab_leaf_pages;
+    if (dir >= SLAB_MAP_DIRS) {
+        return NULL;
+    }
+
+    uint64_t *leaf = arena->slab_map[dir];
+    if (leaf == NULL) {
+        size_t leaf_bytes = slab_leaf_pages / 4;
+        block_t *block = malloc_block(adjust_size(leaf_bytes), NULL);
+        if (block == NULL) {
+            return NULL;
+        }
+        leaf = header_to_payload(block);
+        memset(leaf, 0, leaf_bytes);
+        __atomic_store_n(&arena->slab_map[dir], leaf, __ATOMIC_RELEASE);
+    }
+    return leaf;
+}
+
+/**
+ * @brief Marks or unmarks a run's pages in the current arena's page map
+ *
+ * Marking may allocate the leaves covering the run.
+ *
+ * @param[in] run A run in the current arena, with its page count set
+ * @param[in] is_run Whether to mark the pages as the run's
+ * @return false if the run lies outside the map or a leaf cannot be
+ *         allocated
+ */
+static bool slab_map_set(slab_run_t *run, bool is_run) {
+    size_t first = slab_page(arena, run);
+    if (slab_map_leaf(first) == NULL || slab_map_leaf(first + run->pages - 1) == NULL) {
+        return false;
+    }
+
+    for (size_t i = 0; i < run->pages; i++) {
+        size_t page = first + i;
+        uint64_t *leaf = arena->slab_map[page / slab_leaf_pages];
+        size_t entry = page % slab_leaf_pages;
+        unsigned shift = 2 * (entry % 32);
+        if (is_run) {
+            uint64_t value = (i == 0) ? slab_map_start : slab_map_body;
+            __atomic_fetch_or(&leaf[entry / 32], value << shift, __ATOMIC_RELAXED);
+        } else {
+            __atomic_fetch_and(&leaf[entry / 32], ~((uint64_t)3 << shift), __ATOMIC_RELAXED);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Maps a request size to its slab object size class
+ * @param[in] size Requested bytes, between 1 and MM_SLAB_MAX
+ */
+static unsigned slab_class(size_t size) {
+    return (unsigned)((size - 1) / dsize);
+}
+
+/**
+ * @brief Returns the length of the runs for objects of class `cls`
+ *
+ * Objects of up to 256 bytes get single pages. Larger ones get the
+ * shortest run whose space past the last object, spread over the objects,
+ * is at most half the header a regular block would cost them, or the
+ * longest run if there is none.
+ *
+ * @param[in] cls Slab class of the objects
+ * @return The run length (pages)
+ */
+static size_t slab_run_pages(unsigned cls) {
+    size_t obj_size = (cls + 1) * dsize;
+    if (obj_size <= 256) {
+        return 1;
+    }
+
+    size_t pages = 1;
+    for (; pages < slab_max_pages; pages++) {
+        size_t usable = pages * slab_page_size - wsize - slab_header_size;
+        if (2 * (usable % obj_size) <= (usable / obj_size) * wsize) {
+            break;
+        }
+    }
+    return pages;
+}
+
+/** @brief Pushes a run onto the partial list of its object size */
+static void slab_push_partial(slab_run_t *run) {
+    unsigned cls = slab_class(run->obj_size);
+    run->prev = NULL;
+    run->next = arena->slab_partial[cls];
+    if (run->next != NULL) {
+        run->next->prev = run;
+    }
+    arena->slab_partial[cls] = run;
+}
+
+/** @brief Unlinks a run from the partial list of its object size */
+static void slab_rem_partial(slab_run_t *run) {
+    if (run->prev != NULL) {
+        run->prev->next = run->next;
+    } else {
+        arena->slab_partial[slab_class(run->obj_size)] = run->next;
+    }
+    if (run->next != NULL) {
+        run->next->prev = run->prev;
+    }
+}
+
+/**
+ * @brief Gives an empty run back to the heap
+ * @param[in] run An empty run of the current arena, on no list
+ */
+static void slab_release(slab_run_t *run) {
+    arena->stats.slab_free_bytes -= (size_t)run->nobjs * run->obj_size;
+    slab_map_set(run, false);
+    free_block(payload_to_header(run));
+}
+
+/**
+ * @brief Obtains an empty run for objects of class `cls`
+ *
+ * Reuses the arena's spare run if it has the right length; otherwise
+ * carves a new page-aligned block and marks it in the page map.
+ *
+ * @param[in] cls Slab class of the objects
+ * @return The run, already on its partial list, or NULL on failure
+ */
+static slab_run_t *slab_new_run(unsigned cls) {
+    size_t pages = slab_run_pages(cls);
+    slab_run_t *run = arena->slab_spare;
+
+    if (run != NULL && run->pages == pages) {
+        arena->slab_spare = NULL;
+        arena->stats.slab_free_bytes -= (size_t)run->nobjs * run->obj_size;
+    } else {
+        block_t *block = malloc_aligned_block(pages * slab_page_size, slab_page_size);
+        if (block == NULL) {
+            return NULL;
+        }
+        run = header_to_payload(block);
+        run->pages = (uint16_t)pages;
+        if (!slab_map_set(run, true)) {
+            free_block(block);
+            return NULL;
+        }
+    }
+
+    run->obj_size = (uint32_t)((cls + 1) * dsize);
+    run->nobjs = (uint16_t)((pages * slab_page_size - wsize - slab_header_size) / run->obj_size);
+    run->nfree = run->nobjs;
+    arena->stats.slab_free_bytes += (size_t)run->nobjs * run->obj_size;
+    for (unsigned i = 0; i < 4; i++) {
+        unsigned first = i * 64;
+        if (run->nobjs >= first + 64)  run->free_map[i] = ~(uint64_t)0;
+        else if (run->nobjs > first)   run->free_map[i] = ((uint64_t)1 << (run->nobjs - first)) - 1;
+        else                           run->free_map[i] = 0;
+    }
+
+    slab_push_partial(run);
+    return run;
+}
+
+/**
+ * @brief Allocates a small object from the current arena's slab runs
+ *
+ * The caller must hold the arena lock.
+ *
+ * @param[in] size Requested bytes, between 1 and MM_SLAB_MAX
+ * @return Pointer to the object, or NULL if no run can be obtained
+ */
+static void *slab_alloc(size_t size) {
+    unsigned cls = slab_class(size);
+    slab_run_t *run = arena->slab_partial[cls];
+
+    if (run == NULL) {
+        run = slab_new_run(cls);
+        if (run == NULL) {
+            return NULL;
+        }
+    }
+
+    unsigned i = 0;
+    while (run->free_map[i] == 0) {
+        i++;
+    }
+    unsigned index = i * 64 + (unsigned)__builtin_ctzll(run->free_map[i]);
+    run->free_map[i] &= run->free_map[i] - 1;
+
+    if (--run->nfree == 0) {
+        slab_rem_partial(run);
+    }
+    arena->stats.slab_free_bytes -= run->obj_size;
+    count_malloc(run->obj_size);
+    return (char *)run + slab_header_size + (size_t)index * run->obj_size;
+}
+
+/**
+ * @brief Returns a small object to its run
+ *
+ * A run that becomes empty is kept as the arena's spare, or given back to
+ * the heap if there already is one. The caller must hold the arena lock.
+ *
+ * @param[in] run The run containing bp
+ * @param[in] bp An object allocated from run
+ */
+static void slab_free(slab_run_t *run, void *bp) {
+    size_t index = (size_t)((char *)bp - ((char *)run + slab_header_size)) / run->obj_size;
+    dbg_assert(!((run->free_map[index / 64] >> (index % 64)) & 1));
+
+    run->free_map[index / 64] |= (uint64_t)1 << (index % 64);
+    if (run->nfree++ == 0) {
+        slab_push_partial(run);
+    }
+    arena->stats.slab_free_bytes += run->obj_size;
+    count_free(run->obj_size);
+
+    if (run->nfree == run->nobjs) {
+        slab_rem_partial(run);
+        if (arena->slab_spare == NULL) {
+            arena->slab_spare = run;
+        } else {
+            slab_release(run);
+        }
+    }
+}
+
+/** @brief Forgets all slab state of the current arena */
+static void slab_reset(void) {
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        arena->slab_partial[i] = NULL;
+    }
+    arena->slab_spare = NULL;
+    for (int i = 0; i < SLAB_MAP_DIRS; i++) {
+        arena->slab_map[i] = NULL;
+    }
+}
+
+#else
+
+static void *slab_run_of(arena_t *a, void *bp) {
+    (void)a;
+    (void)bp;
+    return NULL;
+}
+
+static void *slab_alloc(size_t size) {
+    (void)size;
+    return NULL;
+}
+
+static void slab_free(void *run, void *bp) {
+    (void)run;
+    (void)bp;
+}
+
+static void slab_reset(void) {
+}
+
+#endif /* MM_SLAB_MAX > 0 */
+
+/**
+ * @brief Allocates `size` bytes from the current arena
+ *
+ * Small requests go to the slab runs, falling back to an ordinary block if
+ * no run can be had. The caller must hold the arena lock.
+ *
+ * @param[in] size Number of bytes requested (nonzero)
+ * @param[out] zeroed If not NULL, set to whether the payload came from a
+ *                    known-zero block (see clear_payload)
+ * @return Pointer to the payload, or NULL on failure
+ */
+static void *malloc_payload(size_t size, bool *zeroed) {
+    if (zeroed != NULL) {
+        *zeroed = false;
+    }
+
+    if (size <= MM_SLAB_MAX) {
+        void *bp = slab_alloc(size);
+        if (bp != NULL) {
+            return bp;
+        }
+    }
+
+    block_t *block = malloc_block(adjust_size(size), zeroed);
+    if (block == NULL) {
+        return NULL;
+    }
+    count_malloc(get_size(block));
+    return header_to_payload(block);
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *                          BULK COPIES AND FILLS
+ * ---------------------------------------------------------------------------
+ *
+ * realloc copies and calloc fills of at least MM_NT_THRESHOLD bytes use
+ * SSE2 non-temporal stores, which write around the cache: a copy much
+ * larger than the cache would otherwise evict the caller's working set
+ * only to leave behind lines it may never read. Stores here are bound by
+ * memory bandwidth, so wider AVX stores would gain nothing, and SSE2 is
+ * part of every x86-64 CPU, so there is nothing to dispatch on at run
+ * time. Smaller copies and fills stay with memcpy and memset.
+ */
+
+#if MM_NT_THRESHOLD > 0
+
+/** @brief Smallest copy or fill done with non-temporal stores (bytes) */
+static const size_t nt_threshold = MM_NT_THRESHOLD;
+
+/** @brief Bytes moved per iteration of the streaming loops */
+static const size_t stream_unroll = 64;
+
+/**
+ * @brief Copies a payload's contents with non-temporal stores
+ *
+ * @param[out] dst Destination, 16-byte aligned
+ * @param[in] src Source; need not be aligned
+ * @param[in] n Number of bytes
+ */
+static void stream_copy(void *dst, const void *src, size_t n) {
+    __m128i *d = dst;
+    const __m128i *s = src;
+    for (size_t left = n / stream_unroll; left > 0; left--, d += 4, s += 4) {
+        __m128i a = _mm_loadu_si128(s);
+        __m128i b = _mm_loadu_si128(s + 1);
+        __m128i c = _mm_loadu_si128(s + 2);
+        __m128i e = _mm_loadu_si128(s + 3);
+        _mm_stream_si128(d, a);
+        _mm_stream_si128(d + 1, b);
+        _mm_stream_si128(d + 2, c);
+        _mm_stream_si128(d + 3, e);
+    }
+    // Order the streaming stores before the block is handed out
+    _mm_sfence();
+    memcpy(d, s, n % stream_unroll);
+}
+
+/**
+ * @brief Zero-fills a payload with non-temporal stores
+ *
+ * @param[out] dst Destination, 16-byte aligned
+ * @param[in] n Number of bytes
+ */
+static void stream_zero(void *dst, size_t n) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i *d = dst;
+    for (size_t left = n / stream_unroll; left > 0; left--, d += 4) {
+        _mm_stream_si128(d, zero);
+        _mm_stream_si128(d + 1, zero);
+        _mm_stream_si128(d + 2, zero);
+        _mm_stream_si128(d + 3, zero);
+    }
+    _mm_sfence();
+    memset(d, 0, n % stream_unroll);
+}
+
+#endif /* MM_NT_THRESHOLD > 0 */
+
+/**
+ * @brief Copies the contents of a payload being moved by realloc
+ *
+ * @param[out] dst The new payload
+ * @param[in] src The old payload
+ * @param[in] n Number of bytes to copy
+ */
+static void copy_payload(void *dst, const void *src, size_t n) {
+#if MM_NT_THRESHOLD > 0
+    if (n >= nt_threshold) {
+        stream_copy(dst, src, n);
+        return;
+    }
+#endif
+    memcpy(dst, src, n);
+}
+
+/**
+ * @brief Zero-fills the first n bytes of a payload
+ *
+ * @param[out] dst The payload
+ * @param[in] n Number of bytes
+ */
+static void zero_payload(void *dst, size_t n) {
+#if MM_NT_THRESHOLD > 0
+    if (n >= nt_threshold) {
+        stream_zero(dst, n);
+        return;
+    }
+#endif
+    memset(dst, 0, n);
+}
+
+/**
+ * @brief Zero-fills a newly allocated payload
+ *
+ * A payload carved from a known-zero block only holds stale metadata of
+ * that block: its links and tags at the start and, if the whole block was
+ * taken, its footer at the end. Only those words are cleared, so untouched
+ * pages stay unfaulted.
+ *
+ * @param[in] bp A payload from malloc_payload
+ * @param[in] size Number of bytes requested
+ * @param[in] zeroed What malloc_payload reported for bp
+ */
+static void clear_payload(void *bp, size_t size, bool zeroed) {
+    if (!zeroed) {
+        zero_payload(bp, size);
+        return;
+    }
+    block_t *block = payload_to_header(bp);
+    size_t usable = get_payload_size(block);
+    memset(bp, 0, usable < zero_skip ? usable : zero_skip);
+    *header_to_footer(block) = 0;
+}
+
+/**
+ * @brief Frees a payload owned by the current arena
+ *
+ * The caller must hold the arena lock.
+ *
+ * @param[in] bp A payload from malloc_payload
+ */
+static void free_payload(void *bp) {
+    void *run = slab_run_of(arena, bp);
+    if (run != NULL) {
+        slab_free(run, bp);
+        return;
+    }
+
+    block_t *block = payload_to_header(bp);
+    count_free(get_size(block));
+    if (!quick_put(block)) {
+        free_block(block);
+    }
+}
+
+/**
+ * @brief Frees a payload together with the payloads that follow it in the heap
+ *
+ * Consecutive entries of bps that are back-to-back regular blocks (as
+ * malloc_blocks lays them out) are merged into one block first, so the run
+ * costs a single coalesce and list insertion. Slab objects are freed one
+ * at a time. The caller must hold the arena lock.
+ *
+ * @param[in] bps Payloads owned by the current arena; bps[0] is not NULL
+ * @param[in] n Number of entries in bps
+ * @return Number of entries consumed (at least 1)
+ */
+static size_t free_adjacent(void **bps, size_t n) {
+    if (slab_run_of(arena, bps[0]) != NULL) {
+        free_payload(bps[0]);
+        return 1;
+    }
+
+    block_t *first = payload_to_header(bps[0]);
+    block_t *next = find_next(first);
+    size_t count = 1;
+    while (count < n && bps[count] != NULL && payload_to_header(bps[count]) == next) {
+        count_free(get_size(next));
+        next = find_next(next);
+        count++;
+    }
+
+    if (count == 1) {
+        free_payload(bps[0]);
+        return 1;
+    }
+    count_free(get_size(first));
+
+    size_t size = (size_t)((char *)next - (char *)first);
+    write_block(first, size, true, get_prev_alloc(first), get_prev_mini(first));
+    clear_prev_mini(next);
+    free_block(first);
+    return count;
+}
+
+static arena_t *payload_arena(void *bp);
+static bool is_huge(void *bp);
+static size_t huge_usable_size(void *bp);
+
+/**
+ * @brief Returns the number of usable bytes at an allocated payload
+ *
+ * Safe without the arena lock: a live payload's size cannot change.
+ *
+ * @param[in] bp An allocated payload
+ */
+static size_t usable_size(void *bp) {
+    if (is_huge(bp)) {
+        return huge_usable_size(bp);
+    }
+#if MM_SLAB_MAX > 0
+    slab_run_t *run = slab_run_of(payload_arena(bp), bp);
+    if (run != NULL) {
+        return run->obj_size;
+    }
+#endif
+    return get_payload_size(payload_to_header(bp));
+}
+
+/*
+ * ---------------------------------------------------------------------------
+ *                   THREAD SAFETY, ARENAS AND THREAD CACHES
+ * ---------------------------------------------------------------------------
+ *
+ * In MM_THREADS builds every arena is guarded by its own mutex. Each thread
+ * is bound to a home arena on first use (by the CPU it is running on, or
+ * round robin if that is unknown) and allocates only from it. A block freed
+ * by a thread whose home is not the block's owner is pushed onto the
+ * owner's lock-free remote-free queue; whoever next locks that arena
+ * returns the whole queue to the heap in one batch.
+ *
+ * With MM_NUMA_NODES the arenas form one set per node. Each set's slices
+ * prefer their node's memory, a thread's home comes from the set of the
+ * node it runs on (and changes if the thread migrates), and remote frees
+ * that cross nodes are counted for mm_cross_node_frees.
+ *
+ * In front of the arenas each thread keeps a small cache (tcache) of
+ * recently freed payloads, slab objects and ordinary blocks alike. Bin b
+ * holds payloads with at least 16 * (b + 1) usable bytes, up to
+ * tcache_max_size; cached payloads stay allocated as far as the heap and
+ * mm_checkheap are concerned. A hit touches only thread-local state. A miss takes the home arena lock once and
+ * refills the bin with tcache_refill blocks; a free into a full bin takes
+ * the lock once and returns half of the bin.
+ *
+ * In single-threaded builds all of this compiles down to nothing.
+ */
+
+#if MM_THREADS
+
+/** @brief Number of tcache bins (usable sizes 16, 32, ..., 16 * TCACHE_BINS) */
+#define TCACHE_BINS 32
+
+/** @brief Largest request served from the tcache (bytes) */
+static const size_t tcache_max_size = TCACHE_BINS * 16;
+
+/** @brief Most blocks a single bin may hold before it is flushed */
+static const unsigned tcache_limit = 32;
+
+/** @brief Blocks fetched from the heap per bin miss */
+static const unsigned tcache_refill = 8;
+
+/** @brief Per-thread cache; bins are linked through each payload's first word */
+typedef struct tcache {
+    void *bin[TCACHE_BINS];
+    unsigned count[TCACHE_BINS];
+    /** @brief Hits and frees not yet added to an arena's statistics */
+    size_t hits;
+    size_t frees;
+    /** @brief Set once the thread's exit flush has run */
+    bool shutdown;
+} tcache_t;
+
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tcache_key;
+static atomic_uint next_arena;
+static _Thread_local arena_t *home = NULL;
+static _Thread_local tcache_t tcache;
+
+static void tcache_flush(void *arg);
+#if MM_PROF
+static void prof_acquire(void);
+static void prof_release(void);
+#endif
+
+/**
+ * @brief Takes every allocator lock before fork
+ *
+ * A child only has the forking thread, so a lock another thread held at
+ * the fork would never be released there. With every lock taken, a
+ * consistent heap is inherited and usable at once.
+ */
+static void fork_prepare(void) {
+    for (int i = 0; i < MM_ARENAS; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+    }
+#if MM_PROF
+    prof_acquire();
+#endif
+}
+
+/** @brief Releases the locks taken by fork_prepare, in parent and child */
+static void fork_release(void) {
+#if MM_PROF
+    prof_release();
+#endif
+    for (int i = MM_ARENAS - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+}
+
+/**
+ * @brief One-time setup of arena locks, the arena reservation and the key
+ *        used to flush thread caches at thread exit.
+ *
+ * If the reservation fails every arena is left empty and cannot grow, so
+ * allocation fails cleanly with NULL.
+ */
+static void setup_arenas(void) {
+    for (int i = 0; i < MM_ARENAS; i++) {
+        pthread_mutex_init(&arenas[i].lock, NULL);
+        atomic_init(&arenas[i].remote_frees, NULL);
+    }
+
+#if MM_ARENAS > 1
+    // One spare page lets every slice start on a heap page boundary
+    void *base = mmap(NULL, MM_ARENAS * arena_span + heap_page_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base != MAP_FAILED) {
+        arena_base = (char *)round_up((uintptr_t)base, heap_page_size);
+#if MM_HUGE_PAGES == 1
+        madvise(arena_base, MM_ARENAS * arena_span, MADV_HUGEPAGE);
+#endif
+        for (int i = 0; i < MM_ARENAS; i++) {
+            arenas[i].lo = arena_base + i * arena_span;
+            arenas[i].brk = arenas[i].lo;
+            arenas[i].end = arenas[i].lo + arena_span;
+#if MM_HUGE_PAGES == 2
+            arenas[i].committed = arenas[i].lo;
+#endif
+            bind_pages(arenas[i].lo, arena_span);
+        }
+    }
+#endif
+
+    pthread_key_create(&tcache_key, tcache_flush);
+    pthread_atfork(fork_prepare, fork_release, fork_release);
+}
+
+#if MM_NUMA_NODES > 1
+/**
+ * @brief Returns the NUMA node whose arena set contains an arena
+ * @param[in] a The arena
+ */
+static unsigned arena_node(const arena_t *a) {
+    return (unsigned)(a - arenas) / ARENAS_PER_NODE;
+}
+
+/**
+ * @brief Picks an arena from the set of the node the calling thread runs on
+ *
+ * Nodes beyond MM_NUMA_NODES share sets round robin.
+ */
+static arena_t *pick_arena(void) {
+    unsigned cpu, node;
+    if (getcpu(&cpu, &node) != 0) {
+        cpu = atomic_fetch_add(&next_arena, 1);
+        node = 0;
+    }
+    return &arenas[(node % MM_NUMA_NODES) * ARENAS_PER_NODE + cpu % ARENAS_PER_NODE];
+}
+
+/**
+ * @brief Returns whether the calling thread now runs on another node than
+ *        its home arena's
+ */
+static bool home_moved(void) {
+    unsigned node;
+    return getcpu(NULL, &node) == 0 && node % MM_NUMA_NODES != arena_node(home);
+}
+#else
+static arena_t *pick_arena(void) {
+    int cpu = sched_getcpu();
+    unsigned index = (cpu >= 0) ? (unsigned)cpu
+                                : atomic_fetch_add(&next_arena, 1);
+    return &arenas[index % MM_ARENAS];
+}
+
+static bool home_moved(void) {
+    return false;
+}
+#endif /* MM_NUMA_NODES > 1 */
+
+/**
+ * @brief Returns the calling thread's home arena, binding one on first use
+ *
+ * With NUMA node sets, a thread that has migrated to another node is
+ * rebound to an arena of that node's set.
+ */
+static arena_t *home_arena(void) {
+    if (home == NULL) {
+        pthread_once(&arena_once, setup_arenas);
+
+        home = pick_arena();
+
+        // Any non-NULL value makes the key's destructor run at thread exit
+        pthread_setspecific(tcache_key, &tcache);
+    } else if (home_moved()) {
+        home = pick_arena();
+    }
+    return home;
+}
+
+#ifndef DRIVER
+/**
+ * @brief Sets the allocator up while the program is loading
+ *
+ * Reserves the arenas before main runs and binds the main thread to its
+ * arena, so the first malloc only pays for growing that arena's heap.
+ * Allocations made by earlier constructors set things up on first use.
+ */
+__attribute__((constructor)) static void startup(void) {
+    home_arena();
+}
+#endif
+
+/**
+ * @brief Returns the arena whose heap contains a payload
+ * @param[in] bp A payload returned by this allocator
+ */
+static arena_t *payload_arena(void *bp) {
+#if MM_ARENAS > 1
+    return &arenas[(size_t)((char *)bp - arena_base) / arena_span];
+#else
+    (void)bp;
+    return &arenas[0];
+#endif
+}
+
+/**
+ * @brief Frees every payload queued by remote frees to the current arena
+ *
+ * The queue is detached with one atomic exchange, so producers never wait
+ * and the list cannot suffer ABA. The caller must hold the arena lock.
+ */
+static void drain_remote_frees(void) {
+    void *bp = atomic_exchange_explicit(&arena->remote_frees, NULL,
+                                        memory_order_acquire);
+    while (bp != NULL) {
+        void *next = *(void **)bp;
+        free_payload(bp);
+        arena->stats.remote_frees++;
+        bp = next;
+    }
+}
+
+/**
+ * @brief Locks an arena and makes it the current arena
+ *
+ * Any blocks other threads have queued for the arena are freed first.
+ *
+ * @param[in] a The arena to lock
+ */
+static void lock_arena(arena_t *a) {
+    bool waited = pthread_mutex_trylock(&a->lock) != 0;
+    if (waited) {
+        pthread_mutex_lock(&a->lock);
+    }
+    arena = a;
+    a->stats.locks++;
+    a->stats.lock_waits += waited;
+    if (atomic_load_explicit(&a->remote_frees, memory_order_relaxed) != NULL) {
+        drain_remote_frees();
+    }
+}
+
+/**
+ * @brief Releases an arena lock taken by lock_arena
+ * @param[in] a The arena to unlock
+ */
+static void unlock_arena(arena_t *a) {
+    pthread_mutex_unlock(&a->lock);
+}
+
+/**
+ * @brief Queues a payload on its owner's remote-free list without locking
+ *
+ * @param[in] owner The arena containing the payload
+ * @param[in] bp An allocated payload owned by `owner`
+ */
+static void push_remote_free(arena_t *owner, void *bp) {
+#if MM_NUMA_NODES > 1
+    if (arena_node(owner) != arena_node(home)) {
+        atomic_fetch_add_explicit(&owner->cross_node_frees, 1, memory_order_relaxed);
+    }
+#endif
+    void **link = bp;
+    *link = atomic_load_explicit(&owner->remote_frees, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&owner->remote_frees,
+                                                  link, bp,
+                                                  memory_order_release,
+                                                  memory_order_relaxed)) {
+    }
+}
+
+/**
+ * @brief Discards the contents of every arena so the heap can be rebuilt
+ *
+ * Only safe while no other thread is using the allocator.
+ */
+static void reset_arenas(void) {
+    for (int i = 0; i < MM_ARENAS; i++) {
+        arena_t *a = &arenas[i];
+        pthread_mutex_lock(&a->lock);
+        atomic_store(&a->remote_frees, NULL);
+#if MM_ARENAS > 1
+        // Hand the pages back so the slice above the break reads as zero
+        if (a->brk > a->lo) {
+            release_pages(a->lo, (size_t)(a->brk - a->lo));
+        }
+        a->brk = a->lo;
+#if MM_HUGE_PAGES == 2
+        a->committed = a->lo;
+#endif
+#endif
+        arena = a;
+        clear_heap();
+        a->stats = (arena_stats_t){0};
+        pthread_mutex_unlock(&a->lock);
+    }
+}
+
+/**
+ * @brief Adds a thread cache's pending counts to the current arena's statistics
+ *
+ * Called whenever the thread holds an arena lock anyway, so a cache hit
+ * only costs a thread-local increment.
+ *
+ * @param[in] tc The calling thread's tcache
+ */
+static void tcache_fold(tcache_t *tc) {
+    arena->stats.tcache_hits += tc->hits;
+    arena->stats.tcache_frees += tc->frees;
+    tc->hits = 0;
+    tc->frees = 0;
+}
+
+/**
+ * @brief Returns the first `n` payloads of a bin to their arenas
+ *
+ * Payloads owned by the home arena are freed under one lock acquisition;
+ * the rest go to their owners' remote-free queues.
+ *
+ * @param[in] tc The thread cache owning the bin
+ * @param[in] bin The bin to drain
+ * @param[in] n Number of blocks to release (at most the bin's count)
+ */
+static void tcache_release(tcache_t *tc, unsigned bin, unsigned n) {
+    arena_t *a = home_arena();
+    lock_arena(a);
+    tcache_fold(tc);
+    for (unsigned i = 0; i < n; i++) {
+        void *bp = tc->bin[bin];
+        tc->bin[bin] = *(void **)bp;
+
+        arena_t *owner = payload_arena(bp);
+        if (owner == a) {
+            free_payload(bp);
+        } else {
+            push_remote_free(owner, bp);
+        }
+    }
+    unlock_arena(a);
+    tc->count[bin] -= n;
+}
+
+/**
+ * @brief Returns every cached block of a thread to the heap
+ *
+ * Installed as the tcache_key destructor, so it runs when a thread exits.
+ * Afterwards the thread bypasses its cache.
+ *
+ * @param[in] arg The exiting thread's tcache
+ */
+static void tcache_flush(void *arg) {
+    tcache_t *tc = arg;
+    for (unsigned bin = 0; bin < TCACHE_BINS; bin++) {
+        if (tc->count[bin] > 0) {
+            tcache_release(tc, bin, tc->count[bin]);
+        }
+    }
+    if (tc->hits != 0 || tc->frees != 0) {
+        arena_t *a = home_arena();
+        lock_arena(a);
+        tcache_fold(tc);
+        unlock_arena(a);
+    }
+    tc->shutdown = true;
+}
+
+/**
+ * @brief Allocates from the calling thread's cache
+ *
+ * On a miss the bin is refilled from the home arena under a single lock
+ * acquisition. Requests above tcache_max_size bypass the cache.
+ *
+ * @param[in] size Number of bytes requested (nonzero)
+ * @return A payload of at least `size` bytes, or NULL if the request must
+ *         go to the heap
+ */
+static void *tcache_get(size_t size) {
+    tcache_t *tc = &tcache;
+    if (size > tcache_max_size || tc->shutdown) {
+        return NULL;
+    }
+
+    size_t rsize = round_up(size, dsize);
+    unsigned bin = (unsigned)(rsize / dsize) - 1;
+    void *bp = tc->bin[bin];
+
+    if (bp == NULL) {
+        arena_t *a = home_arena();
+        lock_arena(a);
+        tcache_fold(tc);
+        for (unsigned i = 0; i < tcache_refill; i++) {
+            void *fresh = malloc_payload(rsize, NULL);
+            if (fresh == NULL) {
+                break;
+            }
+            *(void **)fresh = tc->bin[bin];
+            tc->bin[bin] = fresh;
+            tc->count[bin]++;
+        }
+        unlock_arena(a);
+
+        bp = tc->bin[bin];
+        if (bp == NULL) {
+            return NULL;
+        }
+    }
+
+    tc->bin[bin] = *(void **)bp;
+    tc->count[bin]--;
+    tc->hits++;
+    return bp;
+}
+
+/**
+ * @brief Caches a payload being freed by the calling thread
+ *
+ * A full bin first returns half of its payloads to the heap.
+ *
+ * @param[in] bp An allocated payload
+ * @param[in] known Bytes the caller knows are usable at bp, or less than
+ *                  dsize to read the size from the block
+ * @return true if the payload was cached, false if it must go to the heap
+ */
+static bool tcache_put(void *bp, size_t known) {
+    tcache_t *tc = &tcache;
+    size_t usable = (known >= dsize) ? known : usable_size(bp);
+    if (usable < dsize || usable >= tcache_max_size + dsize || tc->shutdown) {
+        return false;
+    }
+
+    home_arena();
+    unsigned bin = (unsigned)(usable / dsize) - 1;
+
+    if (tc->count[bin] >= tcache_limit) {
+        tcache_release(tc, bin, tcache_limit / 2);
+    }
+    *(void **)bp = tc->bin[bin];
+    tc->bin[bin] = bp;
+    tc->count[bin]++;
+    tc->frees++;
+    return true;
+}
+
+/**
+ * @brief Forgets the calling thread's cache after the heap is reset
+ */
+static void tcache_reset(void) {
+    for (unsigned bin = 0; bin < TCACHE_BINS; bin++) {
+        tcache.bin[bin] = NULL;
+        tcache.count[bin] = 0;
+    }
+    tcache.hits = 0;
+    tcache.frees = 0;
+}
+
+#else
+
+static arena_t *home_arena(void) {
+    return &arenas[0];
+}
+
+static arena_t *payload_arena(void *bp) {
+    (void)bp;
+    return &arenas[0];
+}
+
+static void lock_arena(arena_t *a) {
+    (void)a;
+}
+
+static void unlock_arena(arena_t *a) {
+    (void)a;
+}
+
+static void push_remote_free(arena_t *owner, void *bp) {
+    (void)owner;
+    (void)bp;
+}
+
+static void reset_arenas(void) {
+}
+
+static void *tcache_get(size_t size) {
+    (void)size;
+    return NULL;
+}
+
+static bool tcache_put(void *bp, size_t known) {
+    (void)bp;
+    (void)known;
+    return false;
+}
+
+static void tcache_reset(void) {
+}
+
+#endif /* MM_THREADS */
+
+/*
+ * ---------------------------------------------------------------------------
+ *                        DIRECT MAPPINGS FOR HUGE BLOCKS
+ * ---------------------------------------------------------------------------
+ *
+ * Requests of at least MM_MMAP_THRESHOLD bytes bypass the arenas: each gets
+ * its own anonymous mapping, which free() unmaps and realloc() resizes with
+ * mremap, so large buffers never fragment the segregated heap and their
+ * memory goes back to the OS as soon as they are freed.
+ *
+ * The payload is preceded by an ordinary allocated header whose size is
+ * the length of the whole mapping, and in front of that by a word holding
+ * the payload's offset from the start of the mapping (dsize unless the
+ * payload had to be aligned further). Huge payloads are recognized by
+ * lying outside every arena's heap, so free() never has to read memory in
+ * front of a slab object to tell them apart. Allocations sampled by the
+ * heap profiler get mappings of their own too, whatever their size, with
+ * the sample record at the start of the mapping.
+ */
+
+#if MM_MMAP_THRESHOLD > 0
+
+/** @brief Smallest request served by a direct mapping (bytes) */
+static const size_t huge_threshold = MM_MMAP_THRESHOLD;
+
+/** @brief Granularity of direct mappings (bytes) */
+static const size_t huge_page_size = (1 << 12);
+
+/**
+ * @brief Set in a huge payload's offset word when its mapping starts with
+ *        a heap profile sample (see prof_malloc)
+ */
+static const word_t huge_sampled_mask = 0x1;
+
+/**
+ * @brief Direct mappings made and unmapped so far, and the bytes mapped now
+ *
+ * Updated outside any arena lock, so atomic in threaded builds.
+ */
+#if MM_THREADS
+static atomic_size_t huge_mallocs;
+static atomic_size_t huge_frees;
+static atomic_size_t huge_bytes;
+#else
+static size_t huge_mallocs;
+static size_t huge_frees;
+static size_t huge_bytes;
+#endif
+
+/**
+ * @brief Returns whether a payload was allocated by huge_malloc
+ *
+ * Safe without any lock: a live payload never moves between the heap and
+ * a mapping, and the heap only grows.
+ *
+ * @param[in] bp A payload returned by this allocator
+ */
+static bool is_huge(void *bp) {
+#if MM_ARENAS > 1
+    return arena_base == NULL ||
+           (size_t)((char *)bp - arena_base) >= MM_ARENAS * arena_span;
+#else
+    return bp < mem_heap_lo() || bp > mem_heap_hi();
+#endif
+}
+
+/**
+ * @brief Returns the word holding a huge payload's offset into its mapping
+ * @param[in] bp A payload returned by huge_malloc
+ */
+static word_t *huge_offset(void *bp) {
+    return (word_t *)((char *)bp - dsize);
+}
+
+/**
+ * @brief Maps a block directly from the OS, with room in front of it
+ *
+ * For alignments above the page size the mapping is over-allocated, and
+ * the whole pages before and after the aligned payload are unmapped again.
+ *
+ * @param[in] size Number of bytes requested
+ * @param[in] align Required payload alignment, a power of two
+ * @param[in] lead Bytes to keep at the start of the mapping, in front of
+ *                 the offset word
+ * @return Pointer to the payload, or NULL if the mapping fails
+ */
+static void *huge_map(size_t size, size_t align, size_t lead) {
+    align = max(align, dsize);
+    if (size > SIZE_MAX / 2 || align > SIZE_MAX / 4) {
+        return NULL;
+    }
+    size_t length = round_up(size + lead + align, huge_page_size);
+
+    char *base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    char *bp = (char *)round_up((uintptr_t)base + lead + dsize, align);
+    char *first = (char *)((uintptr_t)(bp - dsize - lead) & ~(uintptr_t)(huge_page_size - 1));
+    char *end = (char *)round_up((uintptr_t)bp + size, huge_page_size);
+    if (first > base) {
+        munmap(base, (size_t)(first - base));
+    }
+    if (end < base + length) {
+        munmap(end, (size_t)(base + length - end));
+    }
+
+    *huge_offset(bp) = (word_t)(bp - first);
+    payload_to_header(bp)->header = pack((size_t)(end - first), true, true, false);
+    huge_mallocs++;
+    huge_bytes += (size_t)(end - first);
+    return bp;
+}
+
+/**
+ * @brief Maps a huge block directly from the OS
+ *
+ * @param[in] size Number of bytes requested
+ * @param[in] align Required payload alignment, a power of two
+ * @return Pointer to the payload, or NULL if the mapping fails
+ */
+static void *huge_malloc(size_t size, size_t align) {
+    return huge_map(size, align, 0);
+}
+
+/**
+ * @brief Returns the first byte of a huge block's mapping
+ * @param[in] bp A payload returned by huge_malloc
+ */
+static char *huge_base(void *bp) {
+    return (char *)bp - (*huge_offset(bp) & ~huge_sampled_mask);
+}
+
+/**
+ * @brief Returns the number of usable bytes of a huge block
+ * @param[in] bp A payload returned by huge_malloc
+ */
+static size_t huge_usable_size(void *bp) {
+    return get_size(payload_to_header(bp)) - (size_t)((char *)bp - huge_base(bp));
+}
+
+/**
+ * @brief Returns whether a huge block's mapping holds a heap profile sample
+ * @param[in] bp A payload returned by huge_malloc
+ */
+static bool huge_sampled(void *bp) {
+    return (*huge_offset(bp) & huge_sampled_mask) != 0;
+}
+
+#if MM_PROF
+static bool prof_forget(void *bp);
+#endif
+
+/**
+ * @brief Unmaps a huge block
+ *
+ * The mapping of a sampled block may be kept by the profiler for reuse.
+ *
+ * @param[in] bp A payload returned by huge_malloc
+ */
+static void huge_free(void *bp) {
+    size_t length = get_size(payload_to_header(bp));
+    huge_frees++;
+    huge_bytes -= length;
+#if MM_PROF
+    if (huge_sampled(bp) && prof_forget(bp)) {
+        return;
+    }
+#endif
+    munmap(huge_base(bp), length);
+}
+
+/**
+ * @brief Resizes a huge block, letting the kernel move its pages if needed
+ *
+ * A moved block keeps its offset within the first page, so alignments up
+ * to the page size survive.
+ *
+ * @param[in] bp A payload returned by huge_malloc, not sampled (a sample
+ *               record must not move)
+ * @param[in] size New size in bytes, at least huge_threshold
+ * @return The (possibly moved) payload, or NULL with bp left intact
+ */
+static void *huge_realloc(void *bp, size_t size) {
+    dbg_requires(!huge_sampled(bp));
+    size_t offset = *huge_offset(bp);
+    if (size > SIZE_MAX / 2) {
+        return NULL;
+    }
+    size_t length = round_up(offset + size, huge_page_size);
+    size_t old_length = get_size(payload_to_header(bp));
+
+    char *base = mremap(huge_base(bp), old_length, length, MREMAP_MAYMOVE);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    bp = base + offset;
+    payload_to_header(bp)->header = pack(length, true, true, false);
+    huge_bytes += length - old_length;
+    return bp;
+}
+
+/**
+ * @brief Adds the direct mapping counts to a statistics snapshot
+ * @param[out] stats The snapshot being filled in by mm_stats
+ */
+static void huge_stats(mm_stats_t *stats) {
+    stats->huge_mallocs = huge_mallocs;
+    stats->huge_frees = huge_frees;
+    stats->huge_bytes = huge_bytes;
+}
+
+#else
+
+static const size_t huge_threshold = SIZE_MAX;
+
+static bool is_huge(void *bp) {
+    (void)bp;
+    return false;
+}
+
+static void *huge_malloc(size_t size, size_t align) {
+    (void)size;
+    (void)align;
+    return NULL;
+}
+
+static size_t huge_usable_size(void *bp) {
+    (void)bp;
+    return 0;
+}
+
+static void huge_free(void *bp) {
+    (void)bp;
+}
+
+static void *huge_realloc(void *bp, size_t size) {
+    (void)bp;
+    (void)size;
+    return NULL;
+}
+
+static bool huge_sampled(void *bp) {
+    (void)bp;
+    return false;
+}
+
+static void huge_stats(mm_stats_t *stats) {
+    (void)stats;
+}
+
+#endif /* MM_MMAP_THRESHOLD > 0 */
+
+/*
+ * ---------------------------------------------------------------------------
+ *                        SAMPLED HEAP PROFILING
+ * ---------------------------------------------------------------------------
+ *
+ * With MM_PROF each thread counts down the bytes it requests from malloc,
+ * calloc and realloc. When the count goes negative the request is sampled
+ * and a new countdown is drawn from an exponential distribution with mean
+ * MM_PROF_SAMPLE, so samples form a Poisson process over allocated bytes:
+ * every byte is equally likely to be sampled, and a profile scaled by the
+ * sampling rate estimates the live heap. Unsampled requests pay one
+ * thread-local subtraction.
+ *
+ * A sampled request gets a direct mapping of its own (see huge_map) whose
+ * first bytes hold its prof_sample_t: the size requested and the call's
+ * backtrace. The offset word carries huge_sampled_mask, so huge_free knows
+ * to drop the record and no other free ever looks for one. Live records
+ * form one list under prof_lock, which mm_prof_dump writes out in the
+ * legacy pprof heap profile format.
+ *
+ * Mapping and unmapping cost far more than the backtrace, so mappings of
+ * up to PROF_CACHE_PAGES pages, which hold most samples, are kept on
+ * per-length lists when freed and reused by later samples.
+ */
+
+#if MM_PROF
+
+/** @brief Deepest backtrace kept per sample */
+#define PROF_DEPTH 32
+
+/** @brief Longest sample mapping kept for reuse (pages) */
+#define PROF_CACHE_PAGES 4
+
+/** @brief Most mappings kept per length */
+static const unsigned prof_cache_limit = 16;
+
+/** @brief A live sampled allocation, stored at the start of its mapping */
+typedef struct prof_sample {
+    struct prof_sample *next;
+    struct prof_sample *prev;
+    /** @brief Bytes requested */
+    size_t size;
+    size_t depth;
+    void *stack[PROF_DEPTH];
+} prof_sample_t;
+
+/** @brief Live samples, most recent first */
+static prof_sample_t *prof_samples = NULL;
+
+/** @brief Freed sample mappings of i + 1 pages, linked through their first word */
+static void *prof_cache[PROF_CACHE_PAGES];
+static unsigned prof_cache_count[PROF_CACHE_PAGES];
+
+/** @brief Number and bytes of live samples and of every sample taken */
+static size_t prof_live_count = 0;
+static size_t prof_live_bytes = 0;
+static size_t prof_total_count = 0;
+static size_t prof_total_bytes = 0;
+
+#if MM_THREADS
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+/** @brief Bytes the thread may still request before its next sample */
+static _Thread_local int64_t prof_left = 0;
+/** @brief The thread's random state; 0 until its first request */
+static _Thread_local uint64_t prof_rng = 0;
+#else
+static int64_t prof_left = 0;
+static uint64_t prof_rng = 0;
+#endif
+
+/** @brief Takes the lock guarding the sample list */
+static void prof_acquire(void) {
+#if MM_THREADS
+    pthread_mutex_lock(&prof_lock);
+#endif
+}
+
+/** @brief Releases the lock guarding the sample list */
+static void prof_release(void) {
+#if MM_THREADS
+    pthread_mutex_unlock(&prof_lock);
+#endif
+}
+
+/**
+ * @brief Approximates log2(x)
+ *
+ * The mantissa's logarithm comes from a quadratic fit, accurate to about
+ * 0.01, which is plenty for drawing sampling intervals.
+ *
+ * @param[in] x A positive integer
+ */
+static double prof_log2(uint64_t x) {
+    int e = 63 - __builtin_clzll(x);
+    double m = (double)x / (double)((uint64_t)1 << e) - 1.0;
+    return e + m * (1.3465 - 0.3465 * m);
+}
+
+/**
+ * @brief Draws the number of bytes until the thread's next sample
+ *
+ * An exponential variate with mean MM_PROF_SAMPLE, from a uniform 26-bit
+ * variate q: -ln(q / 2^26) * MM_PROF_SAMPLE.
+ */
+static int64_t prof_interval(void) {
+    // xorshift64*
+    uint64_t x = prof_rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    prof_rng = x;
+    uint64_t q = ((x * 0x2545F4914F6CDD1DULL) >> 38) + 1;
+    return (int64_t)((26.0 - prof_log2(q)) * 0.6931471805599453 * MM_PROF_SAMPLE) + 1;
+}
+
+/**
+ * @brief Charges a request to the calling thread's sampling countdown
+ * @param[in] size Number of bytes requested
+ * @return true if the request should go to prof_malloc
+ */
+static bool prof_tick(size_t size) {
+    prof_left -= (int64_t)size;
+    return prof_left < 0;
+}
+
+/**
+ * @brief Returns a mapping for a sampled request, reusing a cached one
+ *
+ * @param[in] size Number of bytes requested
+ * @param[in] zero Whether the payload must read as zero
+ * @return Pointer to the payload, behind room for its prof_sample_t, or
+ *         NULL if the mapping fails
+ */
+static void *prof_map(size_t size, bool zero) {
+    size_t lead = sizeof(prof_sample_t);
+    if (size > SIZE_MAX / 2) {
+        return NULL;
+    }
+    size_t length = round_up(lead + dsize + size, huge_page_size);
+    size_t pages = length / huge_page_size;
+
+    char *base = NULL;
+    if (pages <= PROF_CACHE_PAGES) {
+        prof_acquire();
+        base = prof_cache[pages - 1];
+        if (base != NULL) {
+            prof_cache[pages - 1] = *(void **)base;
+            prof_cache_count[pages - 1]--;
+        }
+        prof_release();
+    }
+    if (base == NULL) {
+        return huge_map(size, dsize, lead);
+    }
+
+    // Lay the cached mapping out the way huge_map would
+    char *bp = base + lead + dsize;
+    *huge_offset(bp) = (word_t)(lead + dsize);
+    payload_to_header(bp)->header = pack(length, true, true, false);
+    huge_mallocs++;
+    huge_bytes += length;
+    if (zero) {
+        memset(bp, 0, size);
+    }
+    return bp;
+}
+
+/**
+ * @brief Allocates and records a sampled request
+ *
+ * A thread's first call only seeds its random state. Sampling stays off
+ * while the backtrace is taken, since the unwinder may allocate the first
+ * time it runs.
+ *
+ * @param[in] size Number of bytes requested (nonzero)
+ * @param[in] zero Whether the payload must read as zero (for calloc)
+ * @return A payload in a mapping of its own, or NULL if the request was
+ *         not sampled after all and must be allocated as usual
+ */
+static void *prof_malloc(size_t size, bool zero) {
+    if (prof_rng == 0) {
+        prof_rng = ((uint64_t)(uintptr_t)&prof_rng * 0x9E3779B97F4A7C15ULL) | 1;
+        prof_left = prof_interval();
+        return NULL;
+    }
+
+    prof_left = INT64_MAX;
+    char *bp = prof_map(size, zero);
+    if (bp == NULL) {
+        prof_left = prof_interval();
+        return NULL;
+    }
+    prof_sample_t *sample = (prof_sample_t *)huge_base(bp);
+    sample->size = size;
+    sample->depth = (size_t)backtrace(sample->stack, PROF_DEPTH);
+    *huge_offset(bp) |= huge_sampled_mask;
+    prof_left = prof_interval();
+
+    prof_acquire();
+    sample->prev = NULL;
+    sample->next = prof_samples;
+    if (prof_samples != NULL) {
+        prof_samples->prev = sample;
+    }
+    prof_samples = sample;
+    prof_live_count++;
+    prof_live_bytes += size;
+    prof_total_count++;
+    prof_total_bytes += size;
+    prof_release();
+    return bp;
+}
+
+/**
+ * @brief Drops the record of a sampled payload being freed
+ *
+ * @param[in] bp A sampled payload
+ * @return true if its mapping was kept for reuse, false if the caller
+ *         must unmap it
+ */
+static bool prof_forget(void *bp) {
+    prof_sample_t *sample = (prof_sample_t *)huge_base(bp);
+    size_t pages = get_size(payload_to_header(bp)) / huge_page_size;
+    bool kept = false;
+
+    prof_acquire();
+    if (sample->prev != NULL) {
+        sample->prev->next = sample->next;
+    } else {
+        prof_samples = sample->next;
+    }
+    if (sample->next != NULL) {
+        sample->next->prev = sample->prev;
+    }
+    prof_live_count--;
+    prof_live_bytes -= sample->size;
+
+    if (pages <= PROF_CACHE_PAGES && prof_cache_count[pages - 1] < prof_cache_limit) {
+        *(void **)sample = prof_cache[pages - 1];
+        prof_cache[pages - 1] = sample;
+        prof_cache_count[pages - 1]++;
+        kept = true;
+    }
+    prof_release();
+    return kept;
+}
+
+/**
+ * @brief Writes all of a buffer to a file descriptor
+ * @return true on success
+ */
+static bool prof_write(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= (size_t)n;
     }
-    return block;
+    return true;
 }
 
 /**
- * @brief Extends heap when no suitable free block exists
+ * @brief Writes the live samples as a legacy pprof heap profile
  *
- * @param[in] size Number of bytes to request (rounded to alignment)
- * @return Pointer to the new free block, or NULL on failure
+ * One line per sample, then the process's memory map so symbols can be
+ * resolved. Output is formatted into a stack buffer and written with
+ * write(2), so dumping never allocates.
+ *
+ * @param[in] fd File descriptor to write to
+ * @return true if everything was written
  */
-static block_t *extend_heap(size_t size) {
-    void *bp;
+static bool prof_dump(int fd) {
+    char buf[4096];
+    size_t used = 0;
+    bool ok = true;
+
+    prof_acquire();
+    used += (size_t)snprintf(buf, sizeof(buf), "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%lld\n",
+                             prof_live_count, prof_live_bytes, prof_total_count,
+                             prof_total_bytes, (long long)MM_PROF_SAMPLE);
+    for (prof_sample_t *s = prof_samples; s != NULL && ok; s = s->next) {
+        // A line takes at most 19 bytes per frame plus the counts
+        if (sizeof(buf) - used < 64 + PROF_DEPTH * 19) {
+            ok = prof_write(fd, buf, used);
+            used = 0;
+        }
+        used += (size_t)snprintf(buf + used, sizeof(buf) - used, "1: %zu [1: %zu] @",
+                                 s->size, s->size);
+        for (size_t i = 0; i < s->depth; i++) {
+            used += (size_t)snprintf(buf + used, sizeof(buf) - used, " 0x%" PRIxPTR,
+                                     (uintptr_t)s->stack[i]);
+        }
+        buf[used++] = '\n';
+    }
+    prof_release();
 
-    // Allocate an even number of words to maintain alignment
-    size = round_up(size, dsize);
-    if ((bp = mem_sbrk((intptr_t)size)) == (void *)-1) {
-        return NULL;
+    static const char maps_title[] = "\nMAPPED_LIBRARIES:\n";
+    ok = ok && prof_write(fd, buf, used) &&
+         prof_write(fd, maps_title, sizeof(maps_title) - 1);
+
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps < 0) {
+        return false;
+    }
+    ssize_t n;
+    while (ok && (n = read(maps, buf, sizeof(buf))) > 0) {
+        ok = prof_write(fd, buf, (size_t)n);
     }
+    close(maps);
+    return ok;
+}
 
-    // Initialize free block header/footer
-    block_t *block = payload_to_header(bp);
-    write_block(block, size, false, get_prev_alloc(block), get_prev_mini(block));
+#else
 
-    // Create new epilogue header
-    block_t *block_next = find_next(block);
-    write_epilogue(block_next);
+static bool prof_tick(size_t size) {
+    (void)size;
+    return false;
+}
 
-    // Coalesce in case the previous block was free
-    block = coalesce_block(block);
-    add_to_free_list(block);
+static void *prof_malloc(size_t size, bool zero) {
+    (void)size;
+    (void)zero;
+    return NULL;
+}
 
-    return block;
+static bool prof_dump(int fd) {
+    (void)fd;
+    return false;
 }
 
-// done
-/**
- * @brief Splits a block if remainder is large enough to be useful
+#endif /* MM_PROF */
+
+/*
+ * ---------------------------------------------------------------------------
+ *                                 REGIONS
+ * ---------------------------------------------------------------------------
  *
- * @param[in] block Pointer to block to split
- * @param[in] asize Desired allocated size (aligned)
+ * A region bump-allocates from chunks of region_chunk_size bytes taken from
+ * the heap with malloc. Nothing is freed individually: mm_region_reset
+ * moves the region's chunks to its spare list, from which later
+ * allocations take them again, so a region reset after every request
+ * stops calling malloc once it has grown to the largest request's needs.
+ * Allocations too big to share a chunk get a chunk of their own, which a
+ * reset frees. A region belongs to one thread at a time.
  */
-static void split_block(block_t *block, size_t asize) {
-    dbg_requires(!get_alloc(block));
-    dbg_requires(!get_mini(block));
-    dbg_requires(asize >= mb_block_size);
-    dbg_requires(asize % dsize == 0);
-
-    size_t block_size = get_size(block);
-    size_t remainder = block_size - asize;
-
-    // block_t *block, size_t size, bool alloc, bool prev_alloc, bool prev_mini
-    if (asize == mb_block_size) {
-        // ALLOCATING first part as MINI
-        if (remainder >= min_block_size) {
-            // CASE: alloc mini | free regular
-            write_block(block, mb_block_size, true, get_prev_alloc(block), get_prev_mini(block));
 
-            block_t *block_next = find_next(block);
-            write_block(block_next, remainder, false, true, true);
-            add_to_free_list(block_next);
+/** @brief Size of a region's regular chunks (bytes) */
+static const size_t region_chunk_size = (1 << 16);
+
+/** @brief Header of a region chunk; the chunk's memory follows it */
+typedef struct region_chunk {
+    struct region_chunk *next;
+    /** @brief Size of the chunk, header included (bytes) */
+    size_t size;
+} region_chunk_t;
+
+struct mm_region {
+    /** @brief Chunks in use, the one being carved first */
+    region_chunk_t *chunks;
+    /** @brief Regular chunks emptied by resets */
+    region_chunk_t *spare;
+    /** @brief Unused part of the first chunk */
+    char *cur;
+    char *end;
+};
 
-            clear_prev_alloc(find_next(block_next));
-            clear_prev_mini(find_next(block_next));
-        } 
-        else if (remainder == mb_block_size) {
-            // CASE: alloc mini | free mini
-            write_block(block, mb_block_size, true, get_prev_alloc(block), get_prev_mini(block));
+/**
+ * @brief Adds a chunk with room for `size` bytes to a region
+ *
+ * The chunk is a spare or a new regular chunk, or for sizes above a
+ * quarter of a regular chunk a chunk of its own, linked behind the current
+ * one so the current chunk's free space is kept.
+ *
+ * @param[in] r The region
+ * @param[in] size Bytes needed, a multiple of dsize
+ * @return The memory for the allocation, or NULL if malloc failed
+ */
+static void *region_grow(mm_region_t *r, size_t size) {
+    region_chunk_t *chunk;
 
-            block_t *block_next = find_next(block);
-            write_block(block_next, mb_block_size, false, true, true);
-            add_to_mini_list(block_next);
-            
-            clear_prev_alloc(find_next(block_next));
-            set_prev_mini(find_next(block_next));
-        } 
-        else {
-            write_block(block, block_size, true, get_prev_alloc(block), get_prev_mini(block));
-            set_prev_alloc(find_next(block));
-            set_prev_mini(find_next(block));
+    if (size > region_chunk_size / 4) {
+        chunk = malloc(sizeof(region_chunk_t) + size);
+        if (chunk == NULL) {
+            return NULL;
         }
-        
+        chunk->size = sizeof(region_chunk_t) + size;
+        if (r->chunks != NULL) {
+            chunk->next = r->chunks->next;
+            r->chunks->next = chunk;
+        } else {
+            chunk->next = NULL;
+            r->chunks = chunk;
+            r->cur = r->end = (char *)(chunk + 1) + size;
+        }
+        return chunk + 1;
+    }
+
+    if (r->spare != NULL) {
+        chunk = r->spare;
+        r->spare = chunk->next;
     } else {
-        // ALLOCATING first part as REGULAR
-        if (remainder >= min_block_size) {
-            // CASE: alloc regular | free reg
-            write_block(block, asize, true, get_prev_alloc(block), get_prev_mini(block));
+        chunk = malloc(region_chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->size = region_chunk_size;
+    }
+    chunk->next = r->chunks;
+    r->chunks = chunk;
+    r->cur = (char *)(chunk + 1) + size;
+    r->end = (char *)chunk + region_chunk_size;
+    return chunk + 1;
+}
 
-            block_t *block_next = find_next(block);
-            write_block(block_next, remainder, false, true, false);
-            add_to_free_list(block_next);
+/**
+ * @brief Resizes an allocation without moving it, if possible
+ *
+ * Slab objects stay put while the new size maps to the same slab class.
+ * Regular blocks are resized by resize_block under their owner's lock,
+ * unless the new size belongs in a slab run or a direct mapping.
+ *
+ * @param[in] ptr An allocated payload
+ * @param[in] size New size in bytes (nonzero, at most SIZE_MAX / 2)
+ * @return true if ptr now holds at least `size` bytes
+ */
+static bool resize_in_place(void *ptr, size_t size) {
+    // Blocks crossing the huge threshold change homes
+    if (is_huge(ptr) || size >= huge_threshold) {
+        return false;
+    }
 
-            clear_prev_alloc(find_next(block_next));
-            clear_prev_mini(find_next(block_next));
-        } 
-        else if (remainder == mb_block_size) {
-            // CASE: alloc regular | Create 16 mini free
-            write_block(block, asize, true, get_prev_alloc(block), get_prev_mini(block));
+    arena_t *owner = payload_arena(ptr);
 
-            block_t *block_next = find_next(block);
-            write_block(block_next, mb_block_size, false, true, false);
-            add_to_mini_list(block_next);
-            
-            clear_prev_alloc(find_next(block_next));
-            set_prev_mini(find_next(block_next));
-        } 
-        else {
-            write_block(block, block_size, true, get_prev_alloc(block), get_prev_mini(block));
-            set_prev_alloc(find_next(block));
-            clear_prev_mini(find_next(block));
-        }
+#if MM_SLAB_MAX > 0
+    slab_run_t *run = slab_run_of(owner, ptr);
+    if (run != NULL) {
+        return size <= MM_SLAB_MAX && slab_class(size) == slab_class(run->obj_size);
     }
-    dbg_ensures(get_alloc(block));
+#endif
+
+    // Small results are denser in a slab run than in a trimmed block
+    if (size <= MM_SLAB_MAX) {
+        return false;
+    }
+
+    lock_arena(owner);
+    bool resized = resize_block(payload_to_header(ptr), adjust_size(size));
+    unlock_arena(owner);
+    return resized;
 }
 
-// done
 /**
- * @brief Searches size classes for a block large enough for request
+ * @brief Checks the order, priorities and blocks of a large-block subtree
  *
- * @param[in] asize Required size (aligned)
- * @return Pointer to suitable free block, or NULL if none found
+ * @param[in] t Root of the subtree
+ * @param[in] lo If not NULL, every node must order after this block
+ * @param[in] hi If not NULL, every node must order before this block
+ * @param[out] count Incremented once per node
+ * @return true if the subtree is consistent
  */
-static block_t *find_fit(size_t asize) {
-    block_t *block;
-    
-    if(asize <= mb_block_size){
-        if(mini_block_head != NULL){
-            return mini_block_head;
-        }
+static bool check_tree(block_t *t, block_t *lo, block_t *hi, int *count) {
+    if (t == NULL) {
+        return true;
     }
-
-    int class = size_to_class(asize);
-    
-    if (size_class[class] != NULL) {
-        for(block = size_class[class]; block != NULL; block = block->next){
-            if(asize <= get_size(block)){
-                return block;
-            }
-        }
+    if (get_alloc(t) || get_size(t) < tree_min_size ||
+        (lo != NULL && !tree_less(lo, t)) || (hi != NULL && !tree_less(t, hi))) {
+        return false;
     }
+    if ((t->left != NULL && tree_priority(t->left) > tree_priority(t)) ||
+        (t->right != NULL && tree_priority(t->right) > tree_priority(t))) {
+        return false;
+    }
+    (*count)++;
+    return check_tree(t->left, lo, t, count) && check_tree(t->right, t, hi, count);
+}
 
-    for(int i = class + 1; i < NUM_CLASSES; i++){
-        block_t *best = NULL;
-        size_t best_size = SIZE_MAX;
-        int search_count = 0;
-        const int MAX_SEARCH = 10;
-        
-        for(block = size_class[i]; block != NULL && search_count < MAX_SEARCH; block = block->next){
-            if(asize <= get_size(block)){
-                if(get_size(block) < best_size){
-                    best = block;
-                    best_size = get_size(block);
-                }
-            }
-            search_count++;
-        }
-        
-        if(best != NULL) return best;
+/**
+ * @brief Returns a heap payload to the arena that owns it
+ *
+ * Payloads owned by another thread's arena are queued on its remote-free
+ * list rather than waiting for its lock.
+ *
+ * @param[in] bp An allocated payload that is not huge
+ */
+static void arena_free(void *bp) {
+    arena_t *owner = payload_arena(bp);
+    if (owner != home_arena()) {
+        push_remote_free(owner, bp);
+        return;
     }
-    
-    return NULL;
+
+    lock_arena(owner);
+    free_payload(bp);
+    unlock_arena(owner);
 }
 
 // done
@@ -915,8 +4792,12 @@ static block_t *find_fit(size_t asize) {
  * @return true if heap is valid, false if corruption detected
  */
 bool mm_checkheap(int line) {
-    
-    word_t *prologue = (word_t *)heap_start - 1;
+    // An arena that has not grown yet has no heap to check
+    if (arena->heap_start == NULL) {
+        return true;
+    }
+
+    word_t *prologue = (word_t *)arena->heap_start - 1;
     if (*prologue != pack(0, true, true, false)) {
         printf("ERROR (line %d): Prologue corrupted\n", line);
         return false;
@@ -925,10 +4806,11 @@ bool mm_checkheap(int line) {
     int totalFreed = 0;
     int trackedFreed = 0;
     int totalAllocated = 0;
+    size_t freeBytes = 0;
 
     block_t *block;
     block_t *prev_block = NULL;
-    for(block = heap_start; get_size(block) > 0; block = find_next(block)){
+    for(block = arena->heap_start; get_size(block) > 0; block = find_next(block)){
         // [ASSERT] block size is multiple of 16
         if(get_size(block) % 16 != 0){
             printf("ERROR (line %d): Block %p not aligned\n", line, (void*)block);
@@ -942,8 +4824,8 @@ bool mm_checkheap(int line) {
         } 
         
         // [ASSERT] block in bounds
-        if((char*)block < (char*)mem_heap_lo() || 
-                  (char*)block > (char*)mem_heap_hi()){
+        if((char*)block < (char*)arena_heap_lo(arena) || 
+                  (char*)block > (char*)arena_heap_hi(arena)){
             printf("ERROR (line %d): Block %p outside heap\n", line, (void*)block);
             return false;
         } 
@@ -979,7 +4861,10 @@ bool mm_checkheap(int line) {
         }
         
 
-        if(!get_alloc(block)) totalFreed++;
+        if(!get_alloc(block)) {
+            totalFreed++;
+            freeBytes += get_size(block);
+        }
         else totalAllocated++;
         prev_block = block;
     }
@@ -991,13 +4876,68 @@ bool mm_checkheap(int line) {
     }
 
     for(int i = 0; i < NUM_CLASSES; i++){
-        for(block_t *block = size_class[i]; block != NULL; block = block -> next){
-            trackedFreed++;
+        // [ASSERT] class bitmap matches list occupancy
+        bool mapped = (arena->class_map >> i) & 1;
+        if(mapped != (arena->size_class[i] != NULL)){
+            printf("ERROR (line %d): Class %d bitmap bit is stale\n", line, i);
+            return false;
+        }
+        size_t listed = 0;
+        for(block_t *block = arena->size_class[i]; block != NULL; block = block -> next){
+            listed++;
+        }
+        // [ASSERT] statistics agree with the list
+        if(listed != arena->stats.class_blocks[i]){
+            printf("ERROR (line %d): Class %d block count is stale\n", line, i);
+            return false;
+        }
+        trackedFreed += (int)listed;
+    }
+#if MM_QUICK_MAX > 0
+    unsigned parked = 0;
+    for(int i = 0; i < QUICK_BINS; i++){
+        for(block_t *block = arena->quick[i]; block != NULL; block = block -> next){
+            // [ASSERT] parked blocks are allocated and on their own size's list
+            if(!get_alloc(block) || get_size(block) != (size_t)(i + 1) * dsize){
+                printf("ERROR (line %d): Quick list block %p is inconsistent\n", line, (void*)block);
+                return false;
+            }
+            parked++;
         }
     }
-    for(block_t *block = mini_block_head; block != NULL; block = block -> next){
+    if(parked != arena->quick_count){
+        printf("ERROR (line %d): Quick list count is stale\n", line);
+        return false;
+    }
+#endif
+    // [ASSERT] the large-block tree is ordered by size and address, and
+    // heap-ordered by priority
+    int tree_nodes = 0;
+    if(!check_tree(arena->tree, NULL, NULL, &tree_nodes)){
+        printf("ERROR (line %d): Large-block tree is inconsistent\n", line);
+        return false;
+    }
+    trackedFreed += tree_nodes;
+    int mini_start = trackedFreed;
+
+    block_t *mini_prev = NULL;
+    for(block_t *block = arena->mini_block_head; block != NULL; block = block -> next){
+        // [ASSERT] mini list back links match forward links
+        if(!(block->header & mini_link_mask) || get_mini_prev(block) != mini_prev){
+            printf("ERROR (line %d): Mini block %p has a bad list link\n", line, (void*)block);
+            return false;
+        }
+        mini_prev = block;
         trackedFreed++;
     }
+
+    // [ASSERT] statistics agree with the tree, mini list and heap
+    if((size_t)tree_nodes != arena->stats.tree_blocks ||
+       (size_t)(trackedFreed - mini_start) != arena->stats.mini_blocks ||
+       freeBytes != arena->stats.free_bytes){
+        printf("ERROR (line %d): Free block statistics are stale\n", line);
+        return false;
+    }
     
     // [ASSERT] blocks in free list match free blocks in heap
     if(trackedFreed != totalFreed){
@@ -1007,19 +4947,110 @@ bool mm_checkheap(int line) {
         dbg_printf("actual allocated: %d\n", totalAllocated);
         return false;
     }
+
+#if MM_SLAB_MAX > 0
+    for(int i = 0; i < SLAB_CLASSES; i++){
+        for(slab_run_t *run = arena->slab_partial[i]; run != NULL; run = run->next){
+            // [ASSERT] partial runs are mapped, sized for their list and
+            // have a free count matching their bitmap
+            int mapped_free = 0;
+            for(int w = 0; w < 4; w++) mapped_free += __builtin_popcountll(run->free_map[w]);
+            if(slab_run_of(arena, run) != run || slab_class(run->obj_size) != (unsigned)i ||
+               run->nfree == 0 || run->nfree != mapped_free){
+                printf("ERROR (line %d): Slab run %p is inconsistent\n", line, (void*)run);
+                return false;
+            }
+        }
+    }
+#endif
     
     return true;
 }
 
-// done
 /**
- * @brief Initializes the allocator with empty heap and free lists
+ * @brief Adds the current arena's blocks to a fragmentation report
  *
- * @return true if successful, false if mem_sbrk fails
+ * The same walk over the heap as mm_checkheap, but read-only and without
+ * checks. The caller must hold the arena lock.
+ *
+ * @param[in,out] frag Report to add to
  */
-bool mm_init(void) {
+static void frag_walk(mm_frag_t *frag) {
+    frag->heap_bytes += (size_t)((char *)arena_heap_hi(arena) + 1 - (char *)arena_heap_lo(arena));
+
+    for (block_t *block = arena->heap_start; get_size(block) > 0; block = find_next(block)) {
+        size_t size = get_size(block);
+        if (!get_alloc(block)) {
+            int class = size_to_class(size);
+            frag->free_blocks++;
+            frag->free_bytes += size;
+            frag->class_blocks[class]++;
+            frag->class_bytes[class] += size;
+            if (size > frag->largest_free) {
+                frag->largest_free = size;
+            }
+            if (get_mini(block)) {
+                frag->mini_free_blocks++;
+            }
+        } else if (slab_run_of(arena, header_to_payload(block)) != NULL) {
+            frag->slab_runs++;
+            frag->slab_bytes += size;
+        } else {
+            frag->alloc_blocks++;
+            frag->alloc_bytes += size;
+            if (get_mini(block)) {
+                frag->mini_alloc_blocks++;
+            }
+        }
+    }
+    frag->slab_free_bytes += arena->stats.slab_free_bytes;
+
+#if MM_QUICK_MAX > 0
+    // Parked blocks look allocated to the walk
+    for (int i = 0; i < QUICK_BINS; i++) {
+        for (block_t *block = arena->quick[i]; block != NULL; block = block->next) {
+            size_t size = get_size(block);
+            frag->quick_blocks++;
+            frag->quick_bytes += size;
+            frag->alloc_blocks--;
+            frag->alloc_bytes -= size;
+            if (get_mini(block)) {
+                frag->mini_alloc_blocks--;
+            }
+        }
+    }
+#endif
+}
+
+/**
+ * @brief Empties the current arena's free lists and forgets its heap
+ *
+ * The next extend_heap creates the heap afresh.
+ */
+static void clear_heap(void) {
+    for(int i = 0; i < NUM_CLASSES; i++){
+        arena->size_class[i] = NULL;
+    }
+    arena->class_map = 0;
+    arena->tree = NULL;
+    quick_reset();
+    slab_reset();
+
+    arena->mini_block_head = NULL;
+    arena->heap_start = NULL;
+}
+
+/**
+ * @brief Lays down the prologue and epilogue of the current arena's heap
+ *
+ * Called by extend_heap when the arena first grows, so no allocation path
+ * has to check for a missing heap. The arena's lists must be empty.
+ *
+ * @return true if successful, false if the heap cannot grow
+ */
+static bool create_heap(void) {
     // Create the initial empty heap
-    word_t *start = (word_t *)(mem_sbrk(2 * wsize));
+    word_t *start = (word_t *)(arena_sbrk(2 * wsize));
 
     if (start == (void *)-1) {
         return false;
@@ -1028,20 +5059,48 @@ bool mm_init(void) {
     start[0] = pack(0, true, true, false); // Heap prologue (block footer)
     start[1] = pack(0, true, true, false); // Heap epilogue (block header)
 
-    for(int i = 0; i < NUM_CLASSES; i++){
-        size_class[i] = NULL;
-    }
-
-    mini_block_head = NULL;
+#if MM_DECAY_MS > 0
+    arena->purge_gen = 1;
+    arena->purge_last_ms = 0;
+#endif
     // Heap starts with first "block header", currently the epilogue
-    heap_start = (block_t *)&(start[1]);
-    //free_list_head = NULL;
+    arena->heap_start = (block_t *)&(start[1]);
+    return true;
+}
+
+/**
+ * @brief Creates an empty heap with a prologue, epilogue and one free chunk
+ *
+ * The caller must hold the current arena's lock.
+ *
+ * @return true if successful, false if the heap cannot grow
+ */
+static bool init_heap(void) {
+    clear_heap();
+    arena->stats = (arena_stats_t){0};
     // Extend the empty heap with a free block of chunksize bytes
-    if (extend_heap(chunksize) == NULL) {
-        return false;
-    }
+    return extend_heap(chunksize) != NULL;
+}
 
-    return true;
+// done
+/**
+ * @brief Initializes the allocator with empty heap and free lists
+ *
+ * In MM_THREADS builds this empties every arena and the calling thread's
+ * cache; no other thread may be using the allocator while it runs.
+ *
+ * @return true if successful, false if mem_sbrk fails
+ */
+bool mm_init(void) {
+    arena_t *a = home_arena();
+
+    reset_arenas();
+    tcache_reset();
+
+    lock_arena(a);
+    bool ok = init_heap();
+    unlock_arena(a);
+    return ok;
 }
 
 /**
@@ -1051,70 +5110,41 @@ bool mm_init(void) {
  * @return Pointer to allocated payload, or NULL on failure
  */
 void *malloc(size_t size) {
-    dbg_requires(mm_checkheap(__LINE__));
-
-    size_t asize;
-    size_t extendsize;
-    block_t *block;
-    void *bp = NULL;
+    void *bp;
 
-    // Initialize heap if it isn't initialized
-    if (heap_start == NULL) {
-        if (!(mm_init())) {
-            dbg_printf("Problem initializing heap. Likely due to sbrk");
-            return NULL;
-        }
-    }
+    trace_event(MM_TRACE_MALLOC, size, 0);
 
     // Ignore spurious request
     if (size == 0) {
-        dbg_ensures(mm_checkheap(__LINE__));
-        return bp;
-    }
-
-    // Adjust block size to include overhead and to meet alignment requirements
-    if(size <= mb_dsize){
-        asize = mb_block_size;
-    } else{
-        asize = max(round_up(size + wsize, dsize), min_block_size);
-    }
-    
-    block = find_fit(asize);
-    // CASE: allocate a mini-block and there is space in the mini-list
-    if(asize == mb_block_size && block != NULL && get_mini(block)){
-        rem_from_mini_list(block);
+        return NULL;
+    }
 
-        write_block(block, mb_block_size, true, get_prev_alloc(block), get_prev_mini(block));
-        
-        set_prev_alloc(find_next(block));
-        set_prev_mini(find_next(block));
-        
-        bp = header_to_payload(block);
-        dbg_ensures(mm_checkheap(__LINE__));
+    // A sampled request gets a mapping of its own and a backtrace
+    if (prof_tick(size) && (bp = prof_malloc(size, false)) != NULL) {
         return bp;
     }
 
-    // If no fit is found, request more memory, and then and place the block
-    if (block == NULL) {
-        // Always request at least chunksize
-        extendsize = max(asize, chunksize);
-        block = extend_heap(extendsize);
-        // extend_heap returns an error
-        if (block == NULL) {
-            return bp;
-        }
+    // Huge requests get their own mapping
+    if (size >= huge_threshold) {
+        return huge_malloc(size, dsize);
     }
 
-    // The block should be marked as free
-    dbg_assert(!get_alloc(block));
+    // Leave room for adjust_size to add the header and round up
+    if (size > SIZE_MAX / 2) {
+        return NULL;
+    }
 
-    // Try to split the block if too large
-    rem_from_free_list(block);
-    split_block(block, asize);
+    // Thread cache hits never touch the shared heap
+    bp = tcache_get(size);
+    if (bp != NULL) {
+        return bp;
+    }
 
-    bp = header_to_payload(block);
+    arena_t *a = home_arena();
+    lock_arena(a);
+    bp = malloc_payload(size, NULL);
+    unlock_arena(a);
 
-    dbg_ensures(mm_checkheap(__LINE__));
     return bp;
 }
 
@@ -1124,41 +5154,39 @@ void *malloc(size_t size) {
  * @param[in] bp Pointer to payload (from malloc/realloc/calloc)
  */
 void free(void *bp) {
-    dbg_requires(mm_checkheap(__LINE__));
-
     if (bp == NULL) {
         return;
     }
+    trace_event(MM_TRACE_FREE, 0, 0);
 
-    block_t *block = payload_to_header(bp);
-    size_t size = get_size(block);
-
-    // The block should be marked as allocated
-    dbg_assert(get_alloc(block));
-
-    // Mark the block as free
-    write_block(block, size, false, get_prev_alloc(block), get_prev_mini(block));
+    if (is_huge(bp)) {
+        huge_free(bp);
+        return;
+    }
 
-    // Try to coalesce the block with its neighbors
-    block = coalesce_block(block);
-    if(get_mini(block)) add_to_mini_list(block);
-    else                add_to_free_list(block);
+    if (tcache_put(bp, 0)) {
+        return;
+    }
 
-    dbg_ensures(mm_checkheap(__LINE__));
+    arena_free(bp);
 }
 
 /**
  * @brief Reallocates a block to a new size
  *
+ * The block is shrunk or grown in place when possible (see
+ * resize_in_place); otherwise the payload is copied to a new block.
+ *
  * @param[in] ptr Pointer to old block
  * @param[in] size New size in bytes
  * @return Pointer to new block, or NULL on failure
  */
 void *realloc(void *ptr, size_t size) {
-    block_t *block = payload_to_header(ptr);
     size_t copysize;
     void *newptr;
 
+    trace_event(MM_TRACE_REALLOC, size, 0);
+
     // If size == 0, then free block and return NULL
     if (size == 0) {
         free(ptr);
@@ -1170,6 +5198,21 @@ void *realloc(void *ptr, size_t size) {
         return malloc(size);
     }
 
+    // Huge blocks that stay huge are remapped rather than copied; a sample
+    // record must stay put, so sampled blocks are copied
+    if (is_huge(ptr) && size >= huge_threshold && !huge_sampled(ptr)) {
+        return huge_realloc(ptr, size);
+    }
+
+    // Leave room for adjust_size to add the header and round up
+    if (size > SIZE_MAX / 2) {
+        return NULL;
+    }
+
+    if (resize_in_place(ptr, size)) {
+        return ptr;
+    }
+
     // Otherwise, proceed with reallocation
     newptr = malloc(size);
 
@@ -1179,11 +5222,11 @@ void *realloc(void *ptr, size_t size) {
     }
 
     // Copy the old data
-    copysize = get_payload_size(block); // gets size of old payload
+    copysize = usable_size(ptr); // gets size of old payload
     if (size < copysize) {
         copysize = size;
     }
-    memcpy(newptr, ptr, copysize);
+    copy_payload(newptr, ptr, copysize);
 
     // Free the old block
     free(ptr);
@@ -1194,12 +5237,17 @@ void *realloc(void *ptr, size_t size) {
 /**
  * @brief Allocates and zero-initializes an array
  *
+ * Huge arrays get a fresh mapping, which already reads as zero and is
+ * faulted in only as it is used. Heap blocks carved from memory known to
+ * be zero (fresh from the OS or purged) are not cleared again.
+ *
  * @param[in] elements Number of elements
  * @param[in] size Size of each element in bytes
  * @return Pointer to zeroed memory, or NULL on failure
  */
 void *calloc(size_t elements, size_t size) {
     void *bp;
+    bool zeroed = false;
     size_t asize = elements * size;
 
     if (elements == 0) {
@@ -1209,18 +5257,544 @@ void *calloc(size_t elements, size_t size) {
         // Multiplication overflowed
         return NULL;
     }
+    if (asize == 0) {
+        return NULL;
+    }
+    trace_event(MM_TRACE_MALLOC, asize, 0);
 
-    bp = malloc(asize);
-    if (bp == NULL) {
+    // Sampled and huge requests get fresh mappings, which read as zero
+    if (prof_tick(asize) && (bp = prof_malloc(asize, true)) != NULL) {
+        return bp;
+    }
+    if (asize >= huge_threshold) {
+        return huge_malloc(asize, dsize);
+    }
+
+    // Leave room for adjust_size to add the header and round up
+    if (asize > SIZE_MAX / 2) {
         return NULL;
     }
 
+    bp = tcache_get(asize);
+    if (bp == NULL) {
+        arena_t *a = home_arena();
+        lock_arena(a);
+        bp = malloc_payload(asize, &zeroed);
+        unlock_arena(a);
+        if (bp == NULL) {
+            return NULL;
+        }
+    }
+
     // Initialize all bits to 0
-    memset(bp, 0, asize);
+    clear_payload(bp, asize, zeroed);
 
     return bp;
 }
 
+/**
+ * @brief Allocates a block whose payload is aligned to `align` bytes
+ *
+ * Heap blocks are carved by malloc_aligned_block, which turns the leading
+ * slack into a free block of its own, so an aligned block occupies no more
+ * of the heap than an unaligned one of the same size. Slab objects and the
+ * thread cache only guarantee dsize alignment and are bypassed.
+ *
+ * @param[in] align Required alignment, a power of two
+ * @param[in] size Number of bytes requested
+ * @return Pointer to the aligned payload, or NULL on failure (with errno
+ *         set to EINVAL for a bad alignment)
+ */
+void *memalign(size_t align, size_t size) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (align <= dsize) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        return NULL;
+    }
+
+    if (size >= huge_threshold) {
+        return huge_malloc(size, align);
+    }
+
+    // Leave room to split off the largest possible slack
+    if (align > SIZE_MAX / 4 || size > SIZE_MAX / 4) {
+        return NULL;
+    }
+
+    arena_t *a = home_arena();
+    lock_arena(a);
+    block_t *block = malloc_aligned_block(adjust_size(size), align);
+    if (block != NULL) {
+        count_malloc(get_size(block));
+    }
+    unlock_arena(a);
+
+    return (block == NULL) ? NULL : header_to_payload(block);
+}
+
+/**
+ * @brief POSIX aligned allocation
+ *
+ * @param[out] memptr Receives the payload
+ * @param[in] align Required alignment, a power of two multiple of
+ *                  sizeof(void *)
+ * @param[in] size Number of bytes requested
+ * @return 0 on success, EINVAL for a bad alignment, ENOMEM on failure
+ */
+int posix_memalign(void **memptr, size_t align, size_t size) {
+    if (align % sizeof(void *) != 0 || (align & (align - 1)) != 0 || align == 0) {
+        return EINVAL;
+    }
+    void *bp = memalign(align, size);
+    if (bp == NULL && size != 0) {
+        return ENOMEM;
+    }
+    *memptr = bp;
+    return 0;
+}
+
+/**
+ * @brief C11 aligned allocation
+ *
+ * @param[in] align Required alignment, a power of two
+ * @param[in] size Number of bytes requested
+ * @return Pointer to the aligned payload, or NULL on failure
+ */
+void *aligned_alloc(size_t align, size_t size) {
+    return memalign(align, size);
+}
+
+/**
+ * @brief Frees a payload whose requested size the caller knows
+ *
+ * The size decides between the huge and heap paths without looking at the
+ * address, and a thread cache hit needs no header or slab map lookup.
+ *
+ * @param[in] ptr Pointer to payload, or NULL
+ * @param[in] size The size requested for ptr by the malloc, calloc or
+ *                 realloc call that returned it, or any size between that
+ *                 and mm_usable_size(ptr)
+ */
+void mm_free_sized(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+    dbg_requires(size <= usable_size(ptr));
+
+    // Route by where the block lives: a size up to the usable size may
+    // cross the huge threshold for a heap block, and sampled payloads are
+    // mapped whatever their size
+    if (is_huge(ptr)) {
+        huge_free(ptr);
+        return;
+    }
+
+    // Bins hold payloads with at least a multiple of dsize usable bytes
+    if (tcache_put(ptr, size - size % dsize)) {
+        return;
+    }
+
+    arena_free(ptr);
+}
+
+/**
+ * @brief Returns the number of bytes usable at an allocated payload
+ *
+ * This is at least the size requested and may be more; the caller may use
+ * all of it.
+ *
+ * @param[in] ptr Pointer to payload, or NULL
+ * @return Usable bytes at ptr, or 0 for NULL
+ */
+size_t mm_usable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    return usable_size(ptr);
+}
+
+/**
+ * @brief Allocates `n` blocks of `size` bytes in one call
+ *
+ * Everything happens under a single acquisition of the home arena's lock,
+ * bypassing the thread cache: slab-sized requests are taken from runs,
+ * and regular blocks are carved back to back from as few free regions as
+ * possible (see malloc_blocks).
+ *
+ * @param[in] size Number of bytes in each block
+ * @param[in] n Number of blocks wanted
+ * @param[out] ptrs Receives the payloads
+ * @return Number of payloads stored; less than `n` only on failure
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs) {
+    size_t count = 0;
+
+    if (size == 0) {
+        return 0;
+    }
+
+    if (size >= huge_threshold) {
+        while (count < n && (ptrs[count] = huge_malloc(size, dsize)) != NULL) {
+            count++;
+        }
+        return count;
+    }
+
+    // Leave room for adjust_size to add the header and round up
+    if (size > SIZE_MAX / 2) {
+        return 0;
+    }
+
+    arena_t *a = home_arena();
+    lock_arena(a);
+    if (size <= MM_SLAB_MAX) {
+        while (count < n && (ptrs[count] = slab_alloc(size)) != NULL) {
+            count++;
+        }
+    }
+    count += malloc_blocks(adjust_size(size), n - count, ptrs + count);
+    unlock_arena(a);
+
+    return count;
+}
+
+/**
+ * @brief Frees `n` payloads in one call
+ *
+ * Payloads owned by the home arena are freed under one lock acquisition,
+ * with runs of neighboring blocks coalesced as one (see free_adjacent);
+ * the rest go to their owners' remote-free queues, and huge blocks are
+ * unmapped.
+ *
+ * @param[in] ptrs Payloads from this allocator; NULL entries are skipped
+ * @param[in] n Number of entries in ptrs
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+    arena_t *a = home_arena();
+    bool locked = false;
+
+    for (size_t i = 0; i < n; i++) {
+        void *bp = ptrs[i];
+        if (bp == NULL) {
+            continue;
+        }
+        if (is_huge(bp)) {
+            huge_free(bp);
+            continue;
+        }
+
+        arena_t *owner = payload_arena(bp);
+        if (owner != a) {
+            push_remote_free(owner, bp);
+            continue;
+        }
+        if (!locked) {
+            lock_arena(a);
+            locked = true;
+        }
+        // Entries that follow bp in the heap are freed with it
+        i += free_adjacent(ptrs + i, n - i) - 1;
+    }
+
+    if (locked) {
+        unlock_arena(a);
+    }
+}
+
+/**
+ * @brief Creates an empty region
+ *
+ * @return The region, or NULL if it cannot be allocated
+ */
+mm_region_t *mm_region_create(void) {
+    mm_region_t *r = malloc(sizeof(mm_region_t));
+    if (r == NULL) {
+        return NULL;
+    }
+    r->chunks = NULL;
+    r->spare = NULL;
+    r->cur = NULL;
+    r->end = NULL;
+    return r;
+}
+
+/**
+ * @brief Allocates `size` bytes from a region
+ *
+ * Bumps a pointer through the region's current chunk, and only asks for
+ * another chunk when that one is full (see region_grow).
+ *
+ * @param[in] r The region
+ * @param[in] size Number of bytes requested
+ * @return Pointer to 16-byte-aligned memory, valid until r is reset or
+ *         destroyed, or NULL if size is 0 or memory ran out
+ */
+void *mm_region_alloc(mm_region_t *r, size_t size) {
+    if (size == 0 || size > SIZE_MAX - region_chunk_size) {
+        return NULL;
+    }
+    size = round_up(size, dsize);
+
+    if ((size_t)(r->end - r->cur) >= size) {
+        void *bp = r->cur;
+        r->cur += size;
+        return bp;
+    }
+    return region_grow(r, size);
+}
+
+/**
+ * @brief Releases everything allocated from a region
+ *
+ * Regular chunks move to the region's spare list for reuse; chunks of
+ * single large allocations are freed. O(chunks).
+ *
+ * @param[in] r The region
+ */
+void mm_region_reset(mm_region_t *r) {
+    region_chunk_t *chunk = r->chunks;
+    while (chunk != NULL) {
+        region_chunk_t *next = chunk->next;
+        if (chunk->size == region_chunk_size) {
+            chunk->next = r->spare;
+            r->spare = chunk;
+        } else {
+            free(chunk);
+        }
+        chunk = next;
+    }
+    r->chunks = NULL;
+    r->cur = NULL;
+    r->end = NULL;
+}
+
+/**
+ * @brief Releases a region and everything allocated from it
+ *
+ * @param[in] r The region, or NULL
+ */
+void mm_region_destroy(mm_region_t *r) {
+    if (r == NULL) {
+        return;
+    }
+    mm_region_reset(r);
+    while (r->spare != NULL) {
+        region_chunk_t *next = r->spare->next;
+        free(r->spare);
+        r->spare = next;
+    }
+    free(r);
+}
+
+/**
+ * @brief Counts frees of a NUMA node's memory made by threads on another node
+ *
+ * @param[in] node A node below MM_NUMA_NODES, or -1 for every node
+ * @return Number of such frees so far; always 0 without MM_NUMA_NODES
+ */
+size_t mm_cross_node_frees(int node) {
+    size_t total = 0;
+#if MM_NUMA_NODES > 1
+    for (int i = 0; i < MM_ARENAS; i++) {
+        if (node < 0 || arena_node(&arenas[i]) == (unsigned)node) {
+            total += atomic_load_explicit(&arenas[i].cross_node_frees, memory_order_relaxed);
+        }
+    }
+#else
+    (void)node;
+#endif
+    return total;
+}
+
+/**
+ * @brief Writes a heap profile of the sampled live allocations
+ *
+ * The output is a legacy pprof heap profile ("heap_v2" at MM_PROF_SAMPLE
+ * bytes per sample) followed by the process's memory map.
+ *
+ * @param[in] fd File descriptor to write to
+ * @return 0 on success, -1 if writing failed or MM_PROF is off
+ */
+int mm_prof_dump(int fd) {
+    return prof_dump(fd) ? 0 : -1;
+}
+
+/**
+ * @brief Takes a snapshot of the allocator's statistics
+ *
+ * Each arena is locked in turn, so the snapshot is consistent per arena
+ * but not across arenas. Thread cache hits and frees are counted once the
+ * thread next takes an arena lock (on a bin miss, a bin flush or exit).
+ *
+ * @param[out] stats Receives the snapshot
+ */
+void mm_stats(mm_stats_t *stats) {
+    *stats = (mm_stats_t){0};
+    stats->num_classes = NUM_CLASSES;
+    home_arena();
+
+    for (int i = 0; i < MM_ARENAS; i++) {
+        arena_t *a = &arenas[i];
+        lock_arena(a);
+        if (a->heap_start != NULL) {
+            const arena_stats_t *s = &a->stats;
+            stats->heap_bytes += (size_t)((char *)arena_heap_hi(a) + 1 - (char *)arena_heap_lo(a));
+            stats->free_bytes += s->free_bytes;
+            stats->slab_free_bytes += s->slab_free_bytes;
+            for (int c = 0; c < NUM_CLASSES; c++) {
+                stats->mallocs[c] += s->mallocs[c];
+                stats->frees[c] += s->frees[c];
+                stats->free_blocks[c] += s->class_blocks[c];
+            }
+            stats->tree_blocks += s->tree_blocks;
+            stats->mini_blocks += s->mini_blocks;
+            stats->tcache_hits += s->tcache_hits;
+            stats->tcache_frees += s->tcache_frees;
+            stats->extends += s->extends;
+            stats->splits += s->splits;
+            stats->coalesces += s->coalesces;
+            stats->fit_probes += s->fit_probes;
+            stats->locks += s->locks;
+            stats->lock_waits += s->lock_waits;
+            stats->remote_frees += s->remote_frees;
+        }
+        unlock_arena(a);
+    }
+
+    stats->in_use_bytes = stats->heap_bytes - stats->free_bytes - stats->slab_free_bytes;
+    huge_stats(stats);
+}
+
+/**
+ * @brief Prints a snapshot of the allocator's statistics
+ *
+ * One summary block, then a line for every size class that has seen any
+ * traffic or holds free blocks.
+ *
+ * @param[in] out Stream to print to
+ */
+void mm_stats_print(FILE *out) {
+    mm_stats_t s;
+    mm_stats(&s);
+
+    double util = (s.heap_bytes == 0) ? 0.0 : 100.0 * (double)s.in_use_bytes / (double)s.heap_bytes;
+    fprintf(out, "heap %zu bytes: %zu in use (%.1f%%), %zu free, %zu in free slab objects\n",
+            s.heap_bytes, s.in_use_bytes, util, s.free_bytes, s.slab_free_bytes);
+    fprintf(out, "huge %zu bytes mapped, %zu mappings made, %zu unmapped\n",
+            s.huge_bytes, s.huge_mallocs, s.huge_frees);
+    fprintf(out, "thread cache %zu hits, %zu frees\n", s.tcache_hits, s.tcache_frees);
+    fprintf(out, "%zu extends, %zu splits, %zu coalesces, %zu fit probes\n",
+            s.extends, s.splits, s.coalesces, s.fit_probes);
+    fprintf(out, "free blocks: %zu mini, %zu in tree\n", s.mini_blocks, s.tree_blocks);
+    fprintf(out, "arena locks %zu taken, %zu contended; %zu remote frees\n",
+            s.locks, s.lock_waits, s.remote_frees);
+
+    fprintf(out, "%5s %21s %12s %12s %8s\n", "class", "sizes", "mallocs", "frees", "free");
+    for (unsigned c = 0; c < s.num_classes; c++) {
+        if (s.mallocs[c] == 0 && s.frees[c] == 0 && s.free_blocks[c] == 0) {
+            continue;
+        }
+        char range[CLASS_RANGE_LEN];
+        fprintf(out, "%5u %21s %12zu %12zu %8zu\n", c, class_range(range, (int)c),
+                s.mallocs[c], s.frees[c], s.free_blocks[c]);
+    }
+}
+
+/**
+ * @brief Chooses which operations the tracing hooks record
+ *
+ * @param[in] ops Bit `op` set for each mm_trace_op to record
+ * @return The previous selection, or 0 if MM_TRACE is off
+ */
+unsigned mm_trace_select(unsigned ops) {
+    return trace_select(ops);
+}
+
+/**
+ * @brief Takes buffered trace events out of every thread's ring
+ *
+ * @param[out] events Receives the events, grouped by ring
+ * @param[in] max Capacity of events
+ * @return Number of events stored
+ */
+size_t mm_trace_drain(mm_trace_event_t *events, size_t max) {
+    return trace_drain(events, max);
+}
+
+/**
+ * @brief Returns how many events full rings have dropped so far
+ */
+size_t mm_trace_dropped(void) {
+    return trace_dropped();
+}
+
+/**
+ * @brief Measures how fragmented the heap is
+ *
+ * Walks each arena's heap in turn under that arena's lock, so allocation
+ * stalls only in the arena being walked, for one pass over its blocks.
+ * Memory held in thread caches counts as allocated.
+ *
+ * @param[out] frag Receives the report
+ */
+void mm_frag_report(mm_frag_t *frag) {
+    *frag = (mm_frag_t){0};
+    frag->num_classes = NUM_CLASSES;
+    home_arena();
+
+    for (int i = 0; i < MM_ARENAS; i++) {
+        arena_t *a = &arenas[i];
+        lock_arena(a);
+        if (a->heap_start != NULL) {
+            frag_walk(frag);
+        }
+        unlock_arena(a);
+    }
+
+    frag->header_bytes = frag->alloc_blocks * wsize;
+    if (frag->free_bytes > 0) {
+        frag->external = 1.0 - (double)frag->largest_free / (double)frag->free_bytes;
+    }
+}
+
+/**
+ * @brief Prints a fragmentation report
+ *
+ * One summary block, then a line for every size class holding free blocks.
+ *
+ * @param[in] out Stream to print to
+ */
+void mm_frag_print(FILE *out) {
+    mm_frag_t f;
+    mm_frag_report(&f);
+
+    double mini_share = (f.free_bytes == 0) ? 0.0 :
+        100.0 * (double)(f.mini_free_blocks * mb_block_size) / (double)f.free_bytes;
+    fprintf(out, "heap %zu bytes: %zu in %zu allocated blocks (%zu in headers), %zu in %zu slab runs (%zu free)\n",
+            f.heap_bytes, f.alloc_bytes, f.alloc_blocks, f.header_bytes,
+            f.slab_bytes, f.slab_runs, f.slab_free_bytes);
+    fprintf(out, "free %zu bytes in %zu blocks, largest %zu, external fragmentation %.1f%%\n",
+            f.free_bytes, f.free_blocks, f.largest_free, 100.0 * f.external);
+    fprintf(out, "mini blocks: %zu free (%.1f%% of free bytes), %zu allocated\n",
+            f.mini_free_blocks, mini_share, f.mini_alloc_blocks);
+    fprintf(out, "quick lists: %zu blocks, %zu bytes\n", f.quick_blocks, f.quick_bytes);
+
+    fprintf(out, "%5s %21s %10s %14s\n", "class", "sizes", "free", "bytes");
+    for (unsigned c = 0; c < f.num_classes; c++) {
+        if (f.class_blocks[c] == 0) {
+            continue;
+        }
+        char range[CLASS_RANGE_LEN];
+        fprintf(out, "%5u %21s %10zu %14zu\n", c, class_range(range, (int)c),
+                f.class_blocks[c], f.class_bytes[c]);
+    }
+}
+
 /*
  *****************************************************************************
  * Do not delete the following super-secret(tm) lines!                       *
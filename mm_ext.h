@@ -0,0 +1,318 @@
+/**
+ * @file mm_ext.h
+ * @brief Extensions to the malloc interface implemented in mm.c
+ *
+ * Everything here works on memory from (and returns memory to) the same
+ * heap as malloc and free.
+ */
+
+#ifndef MM_EXT_H
+#define MM_EXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * @brief Allocates `n` blocks of `size` bytes in one call
+ *
+ * Blocks are carved from as few free regions as possible under a single
+ * arena lock, so the per-object cost is well below that of malloc.
+ *
+ * @param[in] size Number of bytes in each block
+ * @param[in] n Number of blocks wanted
+ * @param[out] ptrs Receives the payloads
+ * @return Number of payloads stored at the start of ptrs; less than `n`
+ *         only if memory ran out
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **ptrs);
+
+/**
+ * @brief Frees `n` payloads in one call
+ *
+ * @param[in] ptrs Payloads from this allocator; NULL entries are skipped
+ * @param[in] n Number of entries in ptrs
+ */
+void mm_free_batch(void **ptrs, size_t n);
+
+/**
+ * @brief Frees a payload whose requested size the caller knows
+ *
+ * Cheaper than free: the size picks the thread cache bin without decoding
+ * the block.
+ *
+ * @param[in] ptr Pointer to payload, or NULL
+ * @param[in] size The size requested for ptr, or any size between that
+ *                 and mm_usable_size(ptr)
+ */
+void mm_free_sized(void *ptr, size_t size);
+
+/**
+ * @brief Returns the number of bytes usable at an allocated payload
+ *
+ * At least the requested size; the caller may use all of it.
+ *
+ * @param[in] ptr Pointer to payload, or NULL
+ * @return Usable bytes at ptr, or 0 for NULL
+ */
+size_t mm_usable_size(void *ptr);
+
+/**
+ * @brief A region: memory allocated piecewise and released all at once
+ *
+ * Regions are not thread-safe; each belongs to one thread at a time.
+ */
+typedef struct mm_region mm_region_t;
+
+/**
+ * @brief Creates an empty region
+ * @return The region, or NULL if memory ran out
+ */
+mm_region_t *mm_region_create(void);
+
+/**
+ * @brief Allocates `size` bytes from a region
+ *
+ * Much cheaper than malloc; the memory cannot be freed on its own.
+ *
+ * @param[in] r The region
+ * @param[in] size Number of bytes requested
+ * @return 16-byte-aligned memory valid until the next mm_region_reset or
+ *         mm_region_destroy of r, or NULL if size is 0 or memory ran out
+ */
+void *mm_region_alloc(mm_region_t *r, size_t size);
+
+/**
+ * @brief Releases everything allocated from a region
+ *
+ * The region keeps its chunks for later allocations, so a region reset at
+ * the end of each request stops calling malloc once it has grown enough.
+ *
+ * @param[in] r The region
+ */
+void mm_region_reset(mm_region_t *r);
+
+/**
+ * @brief Releases a region, its chunks and everything allocated from it
+ * @param[in] r The region, or NULL
+ */
+void mm_region_destroy(mm_region_t *r);
+
+/**
+ * @brief Counts frees of a NUMA node's memory made by threads on another node
+ *
+ * Only builds with MM_NUMA_NODES keep this count.
+ *
+ * @param[in] node A node below MM_NUMA_NODES, or -1 for every node
+ * @return Number of such frees so far, or 0 if not counted
+ */
+size_t mm_cross_node_frees(int node);
+
+/**
+ * @brief Writes a heap profile of the live sampled allocations
+ *
+ * Only builds with MM_PROF sample allocations. The output is a legacy pprof
+ * heap profile followed by the process's memory map, so `pprof <binary>
+ * <file>` can read it. Nothing is allocated while dumping.
+ *
+ * @param[in] fd File descriptor to write to
+ * @return 0 on success, -1 if writing failed or profiling is compiled out
+ */
+int mm_prof_dump(int fd);
+
+/** @brief Upper bound on the number of size classes mm_stats reports */
+#define MM_STATS_CLASSES 64
+
+/**
+ * @brief A snapshot of the allocator's statistics, filled in by mm_stats
+ *
+ * Byte counts and free block counts describe the heap at the time of the
+ * call; everything else counts events since the heap was created.
+ * Allocations and frees are counted where the heap hands out or takes back
+ * a block or slab object, so refills and flushes of thread caches count too;
+ * thread cache hits are counted separately.
+ */
+typedef struct mm_stats {
+    /** @brief Bytes spanned by the arena heaps */
+    size_t heap_bytes;
+    /** @brief Heap bytes in live blocks, thread caches and block headers */
+    size_t in_use_bytes;
+    /** @brief Heap bytes in free blocks */
+    size_t free_bytes;
+    /** @brief Heap bytes in free objects of slab runs */
+    size_t slab_free_bytes;
+    /** @brief Bytes in direct mappings of huge blocks */
+    size_t huge_bytes;
+    size_t huge_mallocs;
+    size_t huge_frees;
+    /** @brief Number of valid entries in the per-class arrays */
+    unsigned num_classes;
+    /** @brief Blocks and slab objects handed out and taken back, by size class */
+    size_t mallocs[MM_STATS_CLASSES];
+    size_t frees[MM_STATS_CLASSES];
+    /** @brief Free blocks on each size class list */
+    size_t free_blocks[MM_STATS_CLASSES];
+    /** @brief Free blocks in the large-block tree and on the mini list */
+    size_t tree_blocks;
+    size_t mini_blocks;
+    /** @brief Allocations served and frees absorbed by thread caches */
+    size_t tcache_hits;
+    size_t tcache_frees;
+    /** @brief Heap extensions, block splits and merges with free neighbors */
+    size_t extends;
+    size_t splits;
+    size_t coalesces;
+    /** @brief Free blocks and tree nodes examined while searching for a fit */
+    size_t fit_probes;
+    /** @brief Arena lock acquisitions, and those that had to wait */
+    size_t locks;
+    size_t lock_waits;
+    /** @brief Blocks freed by a thread other than their arena's */
+    size_t remote_frees;
+} mm_stats_t;
+
+/**
+ * @brief Takes a snapshot of the allocator's statistics
+ *
+ * Cheap enough to call periodically: it locks each arena briefly and does
+ * not walk the heap.
+ *
+ * @param[out] stats Receives the snapshot
+ */
+void mm_stats(mm_stats_t *stats);
+
+/**
+ * @brief Prints mm_stats in a readable form, one line per active size class
+ *
+ * @param[in] out Stream to print to
+ */
+void mm_stats_print(FILE *out);
+
+/**
+ * @brief A fragmentation report, filled in by mm_frag_report
+ *
+ * Requested sizes are not stored, so rounding padding is not counted
+ * directly: a caller that knows its live requested bytes gets it as
+ * alloc_bytes - header_bytes - requested.
+ */
+typedef struct mm_frag {
+    /** @brief Bytes spanned by the arena heaps */
+    size_t heap_bytes;
+    /** @brief Allocated blocks outside slab runs, and their bytes */
+    size_t alloc_blocks;
+    size_t alloc_bytes;
+    /** @brief Bytes of alloc_bytes taken by block headers */
+    size_t header_bytes;
+    /** @brief Slab runs, their bytes, and the bytes of their free objects */
+    size_t slab_runs;
+    size_t slab_bytes;
+    size_t slab_free_bytes;
+    /** @brief Freed blocks parked on quick lists, not yet coalesced */
+    size_t quick_blocks;
+    size_t quick_bytes;
+    /** @brief Free blocks and their bytes */
+    size_t free_blocks;
+    size_t free_bytes;
+    /** @brief Largest free block in any arena */
+    size_t largest_free;
+    /** @brief 1 - largest_free / free_bytes: 0 when free memory is one block */
+    double external;
+    /** @brief Free and allocated 16-byte mini blocks */
+    size_t mini_free_blocks;
+    size_t mini_alloc_blocks;
+    /** @brief Number of valid entries in the per-class arrays */
+    unsigned num_classes;
+    /** @brief Free blocks and their bytes, by size class */
+    size_t class_blocks[MM_STATS_CLASSES];
+    size_t class_bytes[MM_STATS_CLASSES];
+} mm_frag_t;
+
+/**
+ * @brief Walks the heap and reports how fragmented it is
+ *
+ * Each arena is locked only while its own heap is walked, so allocation
+ * elsewhere goes on. The cost is one pass over the arena's blocks.
+ *
+ * @param[out] frag Receives the report
+ */
+void mm_frag_report(mm_frag_t *frag);
+
+/**
+ * @brief Prints mm_frag_report in a readable form, one line per size class
+ *        holding free blocks
+ *
+ * @param[in] out Stream to print to
+ */
+void mm_frag_print(FILE *out);
+
+/**
+ * @brief Operations the tracing hooks record, and what an event's size and
+ *        probes hold for each
+ */
+enum mm_trace_op {
+    /** @brief malloc or calloc entered; size requested */
+    MM_TRACE_MALLOC,
+    /** @brief free entered; size 0 */
+    MM_TRACE_FREE,
+    /** @brief realloc entered; new size. A copying realloc also records
+     *         the malloc and free it makes */
+    MM_TRACE_REALLOC,
+    /** @brief Free block search done; block size wanted, probes = free
+     *         blocks and tree nodes examined */
+    MM_TRACE_FIND_FIT,
+    /** @brief Block split; size of the free remainder */
+    MM_TRACE_SPLIT,
+    /** @brief Freed block merged; merged size, probes = neighbors merged */
+    MM_TRACE_COALESCE,
+    /** @brief Heap extended; bytes added */
+    MM_TRACE_EXTEND,
+};
+
+/** @brief Selection of every mm_trace_op, for mm_trace_select */
+#define MM_TRACE_ALL 0x7fu
+
+/** @brief One traced event */
+typedef struct mm_trace_event {
+    /** @brief CLOCK_MONOTONIC time of the event */
+    uint64_t time_ns;
+    uint64_t size;
+    uint32_t probes;
+    /** @brief Ring the event came from; a ring passes to a new thread
+     *         when its thread exits */
+    uint16_t thread;
+    /** @brief An mm_trace_op */
+    uint8_t op;
+    /** @brief Size class of size, or 0 if size is 0 */
+    uint8_t size_class;
+} mm_trace_event_t;
+
+/**
+ * @brief Chooses which operations are traced
+ *
+ * Only builds with MM_TRACE have tracing hooks; they start out recording
+ * every operation.
+ *
+ * @param[in] ops Bit `1u << op` set for each mm_trace_op to record
+ * @return The previous selection, or 0 if tracing is compiled out
+ */
+unsigned mm_trace_select(unsigned ops);
+
+/**
+ * @brief Takes buffered events out of every thread's trace ring
+ *
+ * Writers never wait for the reader: a full ring drops new events. Meant
+ * for one background reader; a call made while another thread is
+ * draining returns 0.
+ *
+ * @param[out] events Receives the events, in order within each ring
+ * @param[in] max Capacity of events
+ * @return Number of events stored
+ */
+size_t mm_trace_drain(mm_trace_event_t *events, size_t max);
+
+/**
+ * @brief Returns the number of events dropped by full rings so far
+ */
+size_t mm_trace_dropped(void);
+
+#endif /* MM_EXT_H */
@@ -0,0 +1,95 @@
+/**
+ * @file free_sized.c
+ * @brief Checks mm_free_sized at every size it accepts, around the huge threshold
+ *
+ * mm_free_sized takes any size from the one requested up to
+ * mm_usable_size(ptr). For a heap block just below the huge threshold the
+ * usable size reaches past it, so a release path picked by the size alone
+ * would unmap heap pages instead of freeing the block. For requests on
+ * both sides of the threshold this frees one block at its requested size
+ * and one at its usable size, and checks with mincore that the block's
+ * pages were unmapped exactly when it had a mapping of its own.
+ *
+ * Build with the same MM_MMAP_THRESHOLD as mm.c (1 MB by default):
+ *
+ *   gcc -O2 -pthread -Ihandout -I. tests/free_sized.c mm.c -o free_sized && ./free_sized
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "mm_ext.h"
+
+#ifndef MM_MMAP_THRESHOLD
+#define MM_MMAP_THRESHOLD (1 << 20)
+#endif
+
+/** @brief Requests tried on each side of the threshold (bytes) */
+static const size_t window = 256;
+
+/**
+ * @brief Returns whether the page holding an address is still mapped
+ * @param[in] p Any address
+ */
+static bool is_mapped(const void *p) {
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    unsigned char vec;
+    void *start = (void *)((uintptr_t)p & ~(page - 1));
+    return mincore(start, 1, &vec) == 0 || errno != ENOMEM;
+}
+
+/**
+ * @brief Allocates, fills and frees one block through mm_free_sized
+ *
+ * @param[in] size Bytes to request
+ * @param[in] at_usable Free at mm_usable_size rather than at size
+ * @return false if the block was released the wrong way
+ */
+static bool check(size_t size, bool at_usable) {
+    char *p = malloc(size);
+    if (p == NULL) {
+        fprintf(stderr, "malloc(%zu) failed\n", size);
+        return false;
+    }
+
+    size_t usable = mm_usable_size(p);
+    if (usable < size) {
+        fprintf(stderr, "malloc(%zu): only %zu usable bytes\n", size, usable);
+        return false;
+    }
+    memset(p, 0xa5, usable);
+
+    // Requests are mapped by their size, so a page in the middle of the
+    // payload belongs to this block alone whenever it has a mapping
+    char *mid = p + size / 2;
+    bool huge = size >= MM_MMAP_THRESHOLD;
+    mm_free_sized(p, at_usable ? usable : size);
+
+    bool unmapped = !is_mapped(mid);
+    if (huge != unmapped) {
+        fprintf(stderr, "malloc(%zu) %s, freed at %zu: %s\n", size,
+                huge ? "mapped" : "on the heap", at_usable ? usable : size,
+                unmapped ? "unmapped" : "still mapped");
+        return false;
+    }
+    return true;
+}
+
+int main(void) {
+    size_t lo = MM_MMAP_THRESHOLD - window;
+    size_t hi = MM_MMAP_THRESHOLD + window;
+
+    for (size_t size = lo; size <= hi; size++) {
+        if (!check(size, false) || !check(size, true)) {
+            return 1;
+        }
+    }
+    printf("free_sized: ok (%zu to %zu bytes)\n", lo, hi);
+    return 0;
+}